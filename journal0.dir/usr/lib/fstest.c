@@ -0,0 +1,157 @@
+#include "libc.h"
+
+/* fstest: runs from /etc/rc on the journal0 volume (see journal0.setup) */
+/* the volume has a journal with a transaction left to replay, indexed  */
+/* directories and a file that needs double indirect blocks             */
+
+#define BIG 307200      /* 38400 lines of "%07d\n" */
+#define CHUNK 4096
+#define NAMES 300
+
+static char buf[CHUNK];
+static char path[64];
+
+/* byte i of 38400 numbered lines, each "%07d\n" */
+static char pattern(int i) {
+    int line = i / 8;
+    int col = i % 8;
+    if (col == 7) return '\n';
+    for (int j = 6; j > col; j--) line /= 10;
+    return '0' + line % 10;
+}
+
+/* path = dir + "/" + prefix + NNN, a fresh copy every time because
+   touch, mkdir and removeStructure write into it */
+static char* name(const char* dir, char prefix, int n) {
+    int k = 0;
+    while (*dir) path[k++] = *dir++;
+    path[k++] = '/';
+    path[k++] = prefix;
+    path[k++] = '0' + (n / 100) % 10;
+    path[k++] = '0' + (n / 10) % 10;
+    path[k++] = '0' + n % 10;
+    path[k] = 0;
+    return path;
+}
+
+static char* copy(const char* s) {
+    int k = 0;
+    while (s[k]) { path[k] = s[k]; k++; }
+    path[k] = 0;
+    return path;
+}
+
+static int exists(char* fn) {
+    int fd = open(fn, 0);
+    if (fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+static void show(const char* fn) {
+    int fd = open(fn, 0);
+    if (fd < 0) {
+        printf("*** can't open %s\n", fn);
+        return;
+    }
+    cp(fd, 2);
+    close(fd);
+}
+
+/* 1 if fd holds exactly the numbered lines */
+static int check_big(int fd) {
+    if (len(fd) != BIG) {
+        printf("*** %d bytes, expected %d\n", len(fd), BIG);
+        return 0;
+    }
+    for (int at = 0; at < BIG; at += CHUNK) {
+        int n = pread(fd, buf, CHUNK, at);
+        if (n != CHUNK) {
+            printf("*** read %d at %d\n", n, at);
+            return 0;
+        }
+        for (int i = 0; i < CHUNK; i++) {
+            if (buf[i] != pattern(at + i)) {
+                printf("*** wrong byte at %d\n", at + i);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    /* debugfs left a transaction in the journal that replaces this file */
+    show("/etc/replay.txt");
+
+    /* written by debugfs, needs double indirect blocks */
+    int fd = open("/data/big.txt", 0);
+    if (fd >= 0 && check_big(fd)) {
+        printf("*** big.txt: %d bytes of numbered lines\n", BIG);
+    }
+    if (fd >= 0) close(fd);
+
+    /* e2fsck -D turned this one into an htree */
+    int found = 0;
+    for (int i = 0; i < NAMES; i++) {
+        found += exists(name("/data/host", 'f', i));
+    }
+    printf("*** %d of %d names in /data/host\n", found, NAMES);
+
+    /* a directory that grows past one block here */
+    mkdir(copy("/data/many"));
+    for (int i = 0; i < NAMES; i++) {
+        touch(name("/data/many", 'g', i));
+    }
+    found = 0;
+    for (int i = 0; i < NAMES; i++) {
+        found += exists(name("/data/many", 'g', i));
+    }
+    printf("*** %d names in /data/many\n", found);
+
+    for (int i = 0; i < NAMES; i += 2) {
+        removeStructure(name("/data/many", 'g', i));
+    }
+    int left = 0;
+    int right = 1;
+    for (int i = 0; i < NAMES; i++) {
+        int e = exists(name("/data/many", 'g', i));
+        left += e;
+        if (e != (i % 2)) right = 0;
+    }
+    printf("*** %d left in /data/many, %s\n", left,
+        right ? "the right ones" : "the wrong ones");
+
+    /* more than one transaction worth, through the indirect blocks */
+    touch(copy("/data/mine"));
+    fd = open("/data/mine", O_TRUNC);
+    for (int at = 0; at < BIG; at += CHUNK) {
+        for (int i = 0; i < CHUNK; i++) buf[i] = pattern(at + i);
+        if (write(fd, buf, CHUNK) != CHUNK) {
+            printf("*** write failed at %d\n", at);
+            break;
+        }
+    }
+    fsync(fd);
+    if (check_big(fd)) {
+        printf("*** wrote and read back %d bytes\n", BIG);
+    }
+    close(fd);
+
+    /* O_TRUNC gives the blocks back */
+    fd = open("/data/mine", O_TRUNC);
+    write(fd, "*** short\n", 10);
+    printf("*** truncated to %d bytes\n", len(fd));
+    close(fd);
+    show("/data/mine");
+
+    removeStructure(copy("/data/mine"));
+    if (!exists(copy("/data/mine"))) {
+        printf("*** removed /data/mine\n");
+    }
+
+    sync();
+    printf("*** done\n");
+    shutdown();
+    return 0;
+}
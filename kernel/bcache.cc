@@ -0,0 +1,612 @@
+#include "bcache.h"
+#include "debug.h"
+#include "libk.h"
+#include "pit.h"
+#include "threads.h"
+#include "iostat.h"
+
+namespace BCache {
+    // how many buffers have dirty pieces
+    static Atomic<uint32_t> nDirty{0};
+}
+
+void Buffer::load() {
+    if (valid) return;
+
+    LockGuard g{io};
+    if (valid) return;
+
+    // pieces past the end of the device read as zeros
+    uint32_t limit = dev->size_in_bytes() / pieceSize;
+    uint32_t n = BCache::BLOCK_SIZE / pieceSize;
+    uint32_t first = number * n;
+
+    if (first < limit) {
+        dev->read_blocks(first, K::min(n, limit - first), data);
+    }
+
+    valid = true;
+}
+
+void Buffer::mark_dirty(uint32_t offset, uint32_t n) {
+    if (n == 0) return;
+    ASSERT(offset + n <= BCache::BLOCK_SIZE);
+
+    if (dirty == 0) {
+        dirtySince = Pit::jiffies;
+        BCache::nDirty.add_fetch(1);
+    }
+
+    uint32_t first = offset / pieceSize;
+    uint32_t last = (offset + n - 1) / pieceSize;
+    for (uint32_t i = first; i <= last; i++) {
+        dirty |= (1 << i);
+    }
+}
+
+void Buffer::flush() {
+    uint32_t ready = dirty & ~held;
+    if (ready == 0) return;
+
+    uint32_t first = number * (BCache::BLOCK_SIZE / pieceSize);
+    while (ready != 0) {
+        // one command for each run of dirty pieces
+        uint32_t i = __builtin_ctz(ready);
+        uint32_t n = 0;
+        while ((i + n < 32) && ((ready >> (i + n)) & 1)) {
+            ready &= ~(1 << (i + n));
+            n += 1;
+        }
+        dirty &= ~(((n == 32) ? ~0u : ((1u << n) - 1)) << i);
+        dev->write_blocks(first + i, n, data + i * pieceSize);
+    }
+
+    if (dirty == 0) BCache::nDirty.add_fetch(-1);
+}
+
+namespace BCache {
+
+    constexpr static uint32_t NBUCKETS = 1024;
+
+    static Buffer* buckets[NBUCKETS];
+    static Buffer* hand = nullptr;     // the clock ring, nullptr if empty
+    static uint32_t nBuffers = 0;
+    static InterruptSafeLock lock{};
+
+    static uint32_t nHits = 0;
+    static uint32_t nMisses = 0;
+    static uint32_t nClustered = 0;
+
+    // asks the flusher to write back everything
+    static Atomic<bool> urgent{false};
+
+    static Atomic<bool> registered{false};
+
+    static uint32_t hash(BlockIO* dev, uint32_t number) {
+        return ((((uint32_t) dev) >> 4) ^ number) * 2654435761u % NBUCKETS;
+    }
+
+    // call with the lock held
+    static void unlink(Buffer* b) {
+        auto pp = &buckets[hash(b->dev,b->number)];
+        while (*pp != b) pp = &(*pp)->hashNext;
+        *pp = b->hashNext;
+
+        if (b->clockNext == b) {
+            hand = nullptr;
+        } else {
+            b->clockPrev->clockNext = b->clockNext;
+            b->clockNext->clockPrev = b->clockPrev;
+            if (hand == b) hand = b->clockNext;
+        }
+        nBuffers -= 1;
+    }
+
+    // Gives back clean buffers that nobody is using, second chance
+    // for the recently used ones
+    static uint32_t shrink(uint32_t wanted) {
+        Buffer* victims = nullptr;
+        uint32_t freed = 0;
+
+        {
+            LockGuard g{lock};
+            for (uint32_t i = 0; (i < 2 * nBuffers) && (freed < wanted) && (hand != nullptr); i++) {
+                auto b = hand;
+                hand = b->clockNext;
+                if ((b->ref_count.get() != 1) || (b->dirty != 0)) continue;
+                if (b->referenced) {
+                    b->referenced = false;
+                    continue;
+                }
+                unlink(b);
+                b->hashNext = victims;
+                victims = b;
+                freed += 1;
+            }
+        }
+
+        while (victims != nullptr) {
+            auto b = victims;
+            victims = b->hashNext;
+            delete b;
+        }
+
+        // dirty buffers have to be written first, we can't do it here
+        // (the caller could be holding one of them) so the flusher does
+        if ((freed < wanted) && (nDirty.get() != 0)) {
+            urgent.set(true);
+        }
+
+        return freed;
+    }
+
+    static void register_shrinker() {
+        if (!registered.exchange(true)) {
+            PhysMem::shrinker([](uint32_t wanted) -> uint32_t {
+                return shrink(wanted);
+            });
+        }
+    }
+
+    // true if the block is in the cache, doesn't count as a hit
+    static bool cached(BlockIO* dev, uint32_t number) {
+        LockGuard g{lock};
+        for (auto b = buckets[hash(dev,number)]; b != nullptr; b = b->hashNext) {
+            if ((b->dev == dev) && (b->number == number)) return true;
+        }
+        return false;
+    }
+
+    // Finds the buffer, adds "fresh" if there is none and it's not nullptr
+    static Shared<Buffer> lookup(BlockIO* dev, uint32_t number, Buffer* fresh) {
+        LockGuard g{lock};
+
+        auto& bucket = buckets[hash(dev,number)];
+        for (auto b = bucket; b != nullptr; b = b->hashNext) {
+            if ((b->dev == dev) && (b->number == number)) {
+                b->referenced = true;
+                nHits += 1;
+                if (auto s = dev->stats()) s->hit();
+                return Shared<Buffer>{b};
+            }
+        }
+
+        if (fresh == nullptr) return Shared<Buffer>{};
+        if (auto s = dev->stats()) s->miss();
+
+        auto b = fresh;
+        b->ref_count.set(1);
+        b->hashNext = bucket;
+        bucket = b;
+        if (hand == nullptr) {
+            b->clockNext = b;
+            b->clockPrev = b;
+            hand = b;
+        } else {
+            // just behind the hand, last in line for eviction
+            b->clockNext = hand;
+            b->clockPrev = hand->clockPrev;
+            hand->clockPrev->clockNext = b;
+            hand->clockPrev = b;
+        }
+        nBuffers += 1;
+        nMisses += 1;
+        return Shared<Buffer>{b};
+    }
+
+    Shared<Buffer> get(BlockIO* dev, uint32_t number) {
+        ASSERT(BLOCK_SIZE % dev->block_size == 0);
+        ASSERT(BLOCK_SIZE / dev->block_size <= 32);
+
+        register_shrinker();
+
+        auto b = lookup(dev,number,nullptr);
+        if (b == nullptr) {
+            // the frame might come from shrinking the cache and the heap
+            // can block, do both without the lock
+            auto fresh = new Buffer(dev,number,(char*) PhysMem::alloc_frame(true));
+            b = lookup(dev,number,fresh);
+            if (b != fresh) {
+                // somebody beat us to it
+                delete fresh;
+            }
+        }
+
+        b->load();
+        return b;
+    }
+
+    // Large reads that miss bring in a run of blocks with one device
+    // command through this (protected by runLock)
+    constexpr static uint32_t RUN_BLOCKS = 32;
+    static char* runBuffer = nullptr;
+    static BlockingLock runLock{};
+
+    // Loads up to "n" blocks starting at "number" that are not in the
+    // cache yet, returns them in "run" (how many we got, could be 0).
+    // With "into" the device writes straight to it (it has to be kernel
+    // memory with room for n blocks) instead of to the shared run buffer,
+    // and the blocks are copied from there into the cache. That is one
+    // copy instead of two (run buffer to cache, cache to caller) and no
+    // runLock, the cache still ends up with the blocks
+    static uint32_t get_run(BlockIO* dev, uint32_t number, uint32_t n, Shared<Buffer>* run, char* into = nullptr) {
+        uint32_t per = BLOCK_SIZE / dev->block_size;
+        uint32_t limit = dev->size_in_bytes() / dev->block_size;
+        uint32_t k = 0;
+
+        register_shrinker();
+
+        while ((k < n) && ((number + k + 1) * per <= limit) && !cached(dev,number + k)) {
+            auto fresh = new Buffer(dev,number + k,(char*) PhysMem::alloc_frame(true));
+            // nobody can see it before it's valid
+            fresh->io.lock();
+            run[k] = lookup(dev,number + k,fresh);
+            if (run[k] != fresh) {
+                fresh->io.unlock();
+                delete fresh;
+                run[k] = nullptr;
+                break;
+            }
+            k += 1;
+        }
+
+        if (k == 0) return 0;
+
+        auto fill = [k,run](const char* from) {
+            for (uint32_t i = 0; i < k; i++) {
+                memcpy(run[i]->data,from + i * BLOCK_SIZE,BLOCK_SIZE);
+                run[i]->valid = true;
+                run[i]->io.unlock();
+            }
+        };
+
+        if (into != nullptr) {
+            dev->read_blocks(number * per, k * per, into);
+            fill(into);
+        } else {
+            LockGuard g{runLock};
+            if (runBuffer == nullptr) runBuffer = new char[RUN_BLOCKS * BLOCK_SIZE];
+            dev->read_blocks(number * per, k * per, runBuffer);
+            fill(runBuffer);
+        }
+
+        return k;
+    }
+
+    void read(BlockIO* dev, uint32_t offset, uint32_t n, char* buffer) {
+        // user memory belongs to whoever is running, only the kernel's
+        // own memory can be handed to the device
+        bool direct = (uint32_t(buffer) + n <= PhysMem::LOW_LIMIT) && (uint32_t(buffer) + n >= uint32_t(buffer));
+
+        while (n > 0) {
+            auto number = offset / BLOCK_SIZE;
+            auto last = (offset + n - 1) / BLOCK_SIZE;
+
+            Shared<Buffer> run[RUN_BLOCKS];
+            uint32_t k = 0;
+            if (direct && (offset % BLOCK_SIZE == 0) && (n >= 2 * BLOCK_SIZE)) {
+                // whole blocks that miss go straight to the caller (and
+                // get copied into the cache from there)
+                k = get_run(dev,number,K::min(n / BLOCK_SIZE,RUN_BLOCKS),run,buffer);
+                buffer += k * BLOCK_SIZE;
+                offset += k * BLOCK_SIZE;
+                n -= k * BLOCK_SIZE;
+                if (k != 0) continue;
+            } else if (last > number) {
+                k = get_run(dev,number,K::min(last - number + 1,RUN_BLOCKS),run);
+            }
+            if (k == 0) {
+                run[0] = get(dev,number);
+                k = 1;
+            }
+
+            for (uint32_t i = 0; i < k; i++) {
+                auto start = offset % BLOCK_SIZE;
+                auto count = K::min(n,BLOCK_SIZE - start);
+                memcpy(buffer,run[i]->data + start,count);
+                buffer += count;
+                offset += count;
+                n -= count;
+            }
+        }
+    }
+
+    // Read-ahead requests wait here for the read-ahead thread, it
+    // brings them in a run at a time so the caller never blocks on them
+    struct Prefetch {
+        BlockIO* dev;
+        uint32_t first;
+        uint32_t last;
+    };
+
+    constexpr static uint32_t PREFETCH_SLOTS = 32;
+    static Prefetch prefetches[PREFETCH_SLOTS];
+    static uint32_t prefetchHead = 0;
+    static uint32_t prefetchCount = 0;
+    static InterruptSafeLock prefetchLock{};
+    static Semaphore prefetchPending{0};
+    static Atomic<bool> prefetcherStarted{false};
+    static uint32_t nPrefetched = 0;
+
+    static void start_prefetcher() {
+        if (prefetcherStarted.exchange(true)) return;
+        thread([] {
+            while (true) {
+                prefetchPending.down();
+                Prefetch p;
+                {
+                    LockGuard g{prefetchLock};
+                    p = prefetches[prefetchHead];
+                    prefetchHead = (prefetchHead + 1) % PREFETCH_SLOTS;
+                    prefetchCount -= 1;
+                }
+
+                auto number = p.first;
+                while (number <= p.last) {
+                    Shared<Buffer> run[RUN_BLOCKS];
+                    auto k = get_run(p.dev,number,K::min(p.last - number + 1,RUN_BLOCKS),run);
+                    nPrefetched += k;
+                    // already there (or past the end of the device)
+                    number += (k == 0) ? 1 : k;
+                }
+            }
+        });
+    }
+
+    void prefetch(BlockIO* dev, uint32_t offset, uint32_t n) {
+        if (n == 0) return;
+        start_prefetcher();
+
+        {
+            LockGuard g{prefetchLock};
+            if (prefetchCount == PREFETCH_SLOTS) return;
+            auto& p = prefetches[(prefetchHead + prefetchCount) % PREFETCH_SLOTS];
+            p.dev = dev;
+            p.first = offset / BLOCK_SIZE;
+            p.last = (offset + n - 1) / BLOCK_SIZE;
+            prefetchCount += 1;
+        }
+        prefetchPending.up();
+    }
+
+    // Returns the buffers (nullptr dev -> all devices) that satisfy
+    // pred(Buffer*), sorted by device and block number. Doesn't hold
+    // the lock after it returns
+    template <typename Pred>
+    static Shared<Buffer>* collect(BlockIO* dev, Pred pred, uint32_t& n) {
+        n = 0;
+        Shared<Buffer>* all = nullptr;
+        while (true) {
+            // the heap can block, size the array without the lock
+            auto size = nBuffers;
+            all = new Shared<Buffer>[size];
+            {
+                LockGuard g{lock};
+                if (nBuffers <= size) {
+                    auto b = hand;
+                    for (uint32_t i = 0; i < nBuffers; i++) {
+                        if (((dev == nullptr) || (b->dev == dev)) && pred(b)) all[n++] = b;
+                        b = b->clockNext;
+                    }
+                    break;
+                }
+            }
+            delete[] all;
+        }
+
+        // insertion sort, there aren't that many
+        for (uint32_t i = 1; i < n; i++) {
+            for (uint32_t j = i; j > 0; j--) {
+                auto x = all[j-1].ptr;
+                auto y = all[j].ptr;
+                if ((uint32_t(x->dev) < uint32_t(y->dev)) ||
+                    ((x->dev == y->dev) && (x->number < y->number))) break;
+                Shared<Buffer> t = all[j-1];
+                all[j-1] = all[j];
+                all[j] = t;
+            }
+        }
+        return all;
+    }
+
+    // Calls work(Shared<Buffer>) for every buffer of "dev" without
+    // holding the lock while it runs
+    template <typename Work>
+    static void for_each(BlockIO* dev, Work work) {
+        uint32_t n;
+        auto all = collect(dev,[](Buffer*) { return true; },n);
+        for (uint32_t i = 0; i < n; i++) {
+            work(all[i]);
+        }
+        delete[] all;
+    }
+
+    static uint32_t full(Buffer* b) {
+        uint32_t per = BLOCK_SIZE / b->pieceSize;
+        return (per == 32) ? ~uint32_t(0) : ((uint32_t(1) << per) - 1);
+    }
+
+    // all of it can go in one write
+    static bool whole(Buffer* b) {
+        return (b->dirty == full(b)) && (b->held == 0);
+    }
+
+    // Writes the k buffers (completely dirty, next to each other on the
+    // same device) with one transfer
+    static void write_cluster(Shared<Buffer>* run, uint32_t k) {
+        for (uint32_t i = 0; i < k; i++) run[i]->io.lock();
+
+        bool still = true;
+        for (uint32_t i = 0; i < k; i++) {
+            if (!whole(run[i].ptr)) still = false;
+        }
+
+        if (still) {
+            LockGuard g{runLock};
+            if (runBuffer == nullptr) runBuffer = new char[RUN_BLOCKS * BLOCK_SIZE];
+            auto dev = run[0]->dev;
+            auto per = BLOCK_SIZE / dev->block_size;
+            for (uint32_t i = 0; i < k; i++) {
+                memcpy(runBuffer + i * BLOCK_SIZE,run[i]->data,BLOCK_SIZE);
+                run[i]->dirty = 0;
+                nDirty.add_fetch(-1);
+            }
+            dev->write_blocks(run[0]->number * per, k * per, runBuffer);
+            nClustered += 1;
+        } else {
+            // somebody synced some of it under us
+            for (uint32_t i = 0; i < k; i++) run[i]->flush();
+        }
+
+        for (uint32_t i = 0; i < k; i++) run[i]->io.unlock();
+    }
+
+    // Writes back the dirty buffers (of "dev", all if nullptr) that have
+    // been dirty for at least "age" jiffies and satisfy pred
+    template <typename Pred>
+    static void writeback(BlockIO* dev, uint32_t age, Pred pred) {
+        uint32_t n;
+        auto all = collect(dev,[age,pred](Buffer* b) {
+            return (b->dirty != 0) && (int32_t(Pit::jiffies - b->dirtySince) >= int32_t(age)) && pred(b);
+        },n);
+
+        uint32_t i = 0;
+        while (i < n) {
+            auto b = all[i].ptr;
+            uint32_t k = 1;
+            if (whole(b)) {
+                while ((i + k < n) && (k < RUN_BLOCKS)) {
+                    auto c = all[i + k].ptr;
+                    if ((c->dev != b->dev) || (c->number != b->number + k) || !whole(c)) break;
+                    k += 1;
+                }
+            }
+            if (k == 1) {
+                LockGuard g{b->io};
+                b->flush();
+            } else {
+                write_cluster(&all[i],k);
+            }
+            i += k;
+        }
+
+        delete[] all;
+    }
+
+    // The flusher wakes up every FLUSH_INTERVAL and writes back what has
+    // been dirty for DIRTY_AGE. When memory is tight it writes back
+    // everything so the shrinker has something to evict.
+    constexpr static uint32_t FLUSH_INTERVAL = 500;
+    constexpr static uint32_t DIRTY_AGE = 3000;
+    // writers write back themselves past this many dirty buffers
+    constexpr static uint32_t DIRTY_LIMIT = 1024;
+
+    static Atomic<bool> flusherStarted{false};
+
+    static void start_flusher() {
+        if (flusherStarted.exchange(true)) return;
+        thread([] {
+            while (true) {
+                Pit::sleep(FLUSH_INTERVAL);
+                auto age = urgent.exchange(false) ? 0 : DIRTY_AGE;
+                writeback(nullptr,age,[](Buffer*) { return true; });
+            }
+        });
+    }
+
+    void write(BlockIO* dev, uint32_t offset, const char* buffer, uint32_t n) {
+        start_flusher();
+
+        while (n > 0) {
+            auto b = get(dev,offset / BLOCK_SIZE);
+            auto start = offset % BLOCK_SIZE;
+            auto count = K::min(n,BLOCK_SIZE - start);
+            {
+                LockGuard g{b->io};
+                memcpy(b->data + start,buffer,count);
+                b->mark_dirty(start,count);
+            }
+            buffer += count;
+            offset += count;
+            n -= count;
+        }
+
+        if (nDirty.get() > DIRTY_LIMIT) {
+            writeback(dev,0,[](Buffer*) { return true; });
+        }
+    }
+
+    // Sets or clears the held bits of the pieces under [offset,offset+n)
+    static void set_held(BlockIO* dev, uint32_t offset, uint32_t n, bool on) {
+        while (n > 0) {
+            auto b = get(dev,offset / BLOCK_SIZE);
+            auto start = offset % BLOCK_SIZE;
+            auto count = K::min(n,BLOCK_SIZE - start);
+            {
+                LockGuard g{b->io};
+                for (uint32_t i = start / b->pieceSize; i <= (start + count - 1) / b->pieceSize; i++) {
+                    if (on) b->held |= (1 << i); else b->held &= ~(1 << i);
+                }
+            }
+            offset += count;
+            n -= count;
+        }
+    }
+
+    void hold(BlockIO* dev, uint32_t offset, uint32_t n) {
+        set_held(dev,offset,n,true);
+    }
+
+    void release(BlockIO* dev, uint32_t offset, uint32_t n) {
+        set_held(dev,offset,n,false);
+    }
+
+    void sync(BlockIO* dev) {
+        writeback(dev,0,[](Buffer*) { return true; });
+        dev->flush_cache();
+    }
+
+    void sync(BlockIO* dev, uint32_t offset, uint32_t n) {
+        if (n == 0) return;
+        uint32_t first = offset / BLOCK_SIZE;
+        uint32_t last = (offset + n - 1) / BLOCK_SIZE;
+        writeback(dev,0,[first,last](Buffer* b) {
+            return (b->number >= first) && (b->number <= last);
+        });
+    }
+
+    void invalidate(BlockIO* dev) {
+        for_each(dev,[](Shared<Buffer> b) {
+            {
+                LockGuard g{b->io};
+                b->flush();
+                // held pieces are still dirty, the journal that holds
+                // them hasn't committed. They stay, dropping the buffer
+                // would lose them
+                if (b->dirty != 0) {
+                    Debug::printf("| bcache: block %d is held, not invalidated\n",b->number);
+                    return;
+                }
+            }
+            LockGuard g{lock};
+            unlink(b.ptr);
+            b->ref_count.add_fetch(-1);    // the cache's reference
+        });
+    }
+
+    uint32_t hits() {
+        return nHits;
+    }
+
+    uint32_t misses() {
+        return nMisses;
+    }
+
+    uint32_t dirty() {
+        return nDirty.get();
+    }
+
+    uint32_t prefetched() {
+        return nPrefetched;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include "stdint.h"
+#include "atomic.h"
+#include "shared.h"
+#include "blocking_lock.h"
+#include "block_io.h"
+#include "physmem.h"
+
+//
+// The buffer cache
+//
+// Keeps recently used device blocks in memory. Everything that talks to
+// a disk on behalf of a file system goes through here.
+//
+// Cached blocks are BCache::BLOCK_SIZE bytes (a frame) regardless of the
+// device block size. A cached block is made of device blocks ("pieces"),
+// each piece has its own dirty bit so a 128 byte inode update doesn't
+// write the whole frame back.
+//
+// Writes only dirty the cache. A flusher thread writes back buffers that
+// have been dirty for a while, neighbors together, and sync() is there
+// for durability points. Pieces can be held back (hold) until a file
+// system's journal has committed the change in them, writeback skips
+// them until they're released.
+//
+//     {
+//         auto b = BCache::get(dev,offset / BCache::BLOCK_SIZE);
+//         ... b->data ...
+//     }    // the buffer can be evicted once all the handles are gone
+//
+class Buffer {
+public:
+    Atomic<uint32_t> ref_count{0};   // the cache holds one
+
+    BlockIO* const dev;
+    const uint32_t number;           // in units of BCache::BLOCK_SIZE
+    char* const data;                // one frame
+    const uint32_t pieceSize;        // the device block size
+
+    volatile bool valid = false;     // data has been read
+    volatile uint32_t dirty = 0;     // one bit per piece
+    volatile uint32_t held = 0;      // pieces that can't be written back yet
+    uint32_t dirtySince = 0;         // jiffies
+    volatile bool referenced = true; // for the clock
+
+    // held while reading, changing or writing the data
+    BlockingLock io{};
+
+    // owned by the cache (under its lock)
+    Buffer* hashNext = nullptr;
+    Buffer* clockNext = nullptr;
+    Buffer* clockPrev = nullptr;
+
+    Buffer(BlockIO* dev, uint32_t number, char* data) :
+        dev(dev), number(number), data(data), pieceSize(dev->block_size) {}
+
+    Buffer(const Buffer&) = delete;
+
+    ~Buffer() {
+        ASSERT(dirty == 0);
+        PhysMem::dealloc_frame((uint32_t) data);
+    }
+
+    // Reads the data from the device if we don't have it yet
+    void load();
+
+    // Marks the bytes in [offset,offset+n) as dirty, call with io held
+    void mark_dirty(uint32_t offset, uint32_t n);
+
+    // Writes the dirty pieces that aren't held to the device, call with
+    // io held
+    void flush();
+};
+
+namespace BCache {
+
+    constexpr uint32_t BLOCK_SIZE = PhysMem::FRAME_SIZE;
+
+    // Returns a handle on the (loaded) block "number" of "dev"
+    Shared<Buffer> get(BlockIO* dev, uint32_t number);
+
+    // Copies "n" bytes starting at byte "offset" of "dev"
+    void read(BlockIO* dev, uint32_t offset, uint32_t n, char* buffer);
+
+    // Starts bringing [offset,offset+n) of "dev" into the cache and
+    // returns without waiting (read-ahead). Best effort, requests are
+    // dropped when the read-ahead thread is too far behind
+    void prefetch(BlockIO* dev, uint32_t offset, uint32_t n);
+
+    // Updates "n" bytes starting at byte "offset" of "dev". The change
+    // stays in the cache until the flusher (or a sync) writes it back
+    void write(BlockIO* dev, uint32_t offset, const char* buffer, uint32_t n);
+
+    // Keeps the pieces under [offset,offset+n) of "dev" from being
+    // written back until they're released
+    void hold(BlockIO* dev, uint32_t offset, uint32_t n);
+    void release(BlockIO* dev, uint32_t offset, uint32_t n);
+
+    // Writes back every dirty buffer of "dev" and flushes the device
+    void sync(BlockIO* dev);
+
+    // Same for the buffers that cover [offset,offset+n) (fsync)
+    void sync(BlockIO* dev, uint32_t offset, uint32_t n);
+
+    // Syncs and forgets every buffer of "dev", call it before the
+    // device goes away. Buffers with held pieces are left alone
+    void invalidate(BlockIO* dev);
+
+    uint32_t hits();
+    uint32_t misses();
+    uint32_t dirty();
+    uint32_t prefetched();
+}
+
+#endif
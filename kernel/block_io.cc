@@ -9,27 +9,37 @@ int64_t BlockIO::read(uint32_t offset, uint32_t desired_n, char* buffer) {
     if (offset == sz) return 0;
 
     auto n = K::min(desired_n,sz - offset);
-    //auto end_offset = K::min(offset+n,sz);
     auto block_number = offset / block_size;
     auto offset_in_block = offset % block_size;
+
+    if ((offset_in_block == 0) && (n >= block_size)) {
+        // whole blocks go straight to the caller, as many as we can
+        auto count = n / block_size;
+        read_blocks(block_number,count,buffer);
+        return count * block_size;
+    }
+
     auto actual_n = K::min(block_size - offset_in_block, n);
-    ASSERT(actual_n <= n);
     ASSERT(offset + actual_n <= sz);
-    if (actual_n == block_size) {
-        //Debug::printf("reading whole block %d\n",block_number);
-        ASSERT(offset_in_block == 0);
-        // we can read in-place
-        read_block(block_number,buffer);
-    } else {
-        ASSERT(offset_in_block + actual_n <= block_size);
-        char* temp = new char[block_size];
-        //Debug::printf("reading partial block %d\n",block_number);
+    read_part(block_number,offset_in_block,actual_n,buffer);
+    return actual_n;
+}
+
+void BlockIO::read_part(uint32_t block_number, uint32_t offset, uint32_t n, char* buffer) {
+    ASSERT(offset + n <= block_size);
+    // a sector fits on the stack, bigger blocks would eat too much of it
+    // (the file system's Node reads its blocks out of the cache instead)
+    constexpr uint32_t ON_STACK = 512;
+    if (block_size <= ON_STACK) {
+        char temp[ON_STACK];
         read_block(block_number,temp);
-        //Debug::printf("getting %d bytes starting at block offset %d\n",actual_n,offset_in_block);
-        ::memcpy(buffer,&temp[offset_in_block],actual_n);
-        delete []temp;
+        ::memcpy(buffer,&temp[offset],n);
+        return;
     }
-    return actual_n;
+    char* temp = new char[block_size];
+    read_block(block_number,temp);
+    ::memcpy(buffer,&temp[offset],n);
+    delete []temp;
 }
 
 int64_t BlockIO::read_all(uint32_t offset, uint32_t n, char* buffer) {
@@ -3,6 +3,9 @@
 
 #include "stdint.h"
 #include "debug.h"
+#include "atomic.h"
+
+class IoStats;
 
 //
 // Base class for things that support block IO (disks, files, directories, etc)
@@ -21,9 +24,13 @@
 //
 class BlockIO {
 public:
+    Atomic<uint32_t> ref_count{0};     // for Shared<>
+
     const uint32_t block_size;
     BlockIO(uint32_t block_size): block_size(block_size) {}
 
+    virtual ~BlockIO() {}
+
     // get number of bytes
     virtual uint32_t size_in_bytes() = 0;
 
@@ -36,6 +43,39 @@ public:
     // Read a block and put its bytes in the given buffer
     virtual void read_block(uint32_t block_number, char* buffer) = 0;
 
+    // Write a whole block, only devices support it
+    virtual void write_block(uint32_t block_number, const char* buffer) {
+        Debug::panic("write_block not supported\n");
+    }
+
+    // Read "count" consecutive blocks starting at "first". Devices
+    // override it to move the whole range with as few commands as possible
+    virtual void read_blocks(uint32_t first, uint32_t count, char* buffer) {
+        for (uint32_t i = 0; i < count; i++) {
+            read_block(first + i, buffer + i * block_size);
+        }
+    }
+
+    virtual void write_blocks(uint32_t first, uint32_t count, const char* buffer) {
+        for (uint32_t i = 0; i < count; i++) {
+            write_block(first + i, buffer + i * block_size);
+        }
+    }
+
+    // Copy "n" bytes starting at byte "offset" of block "block_number",
+    // they don't cross into the next block. The default reads the whole
+    // block into a temporary (on the stack for sectors), things that sit
+    // on top of the buffer cache copy straight out of the cached block
+    virtual void read_part(uint32_t block_number, uint32_t offset, uint32_t n, char* buffer);
+
+    // Counters for the device, nullptr for things that aren't devices
+    virtual IoStats* stats() {
+        return nullptr;
+    }
+
+    // Makes the blocks written so far durable (drives have caches too)
+    virtual void flush_cache() {}
+
     // Read up to "n" bytes starting at "offset" and put the restuls in "buffer".
     // returns:
     //   > 0  actual number of bytes read
@@ -52,10 +92,17 @@ public:
     //
     virtual int64_t read_all(uint32_t offset, uint32_t n, char* buffer);
 
+    // Small things (headers, directory entry fields) usually live in one
+    // block and are copied out of it directly
     template <typename T>
     void read(uint32_t offset, T& thing) {
-        auto cnt = read_all(offset,sizeof(T),(char*)&thing);
-        ASSERT(cnt == sizeof(T));
+        auto offset_in_block = offset % block_size;
+        if ((offset_in_block + sizeof(T) <= block_size) && (offset + sizeof(T) <= size_in_bytes())) {
+            read_part(offset / block_size,offset_in_block,sizeof(T),(char*)&thing);
+        } else {
+            auto cnt = read_all(offset,sizeof(T),(char*)&thing);
+            ASSERT(cnt == sizeof(T));
+        }
     }
 };
 
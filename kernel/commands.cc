@@ -127,8 +127,14 @@ bool CommandRunner::execute(char *cmd) {
             return false;
         }
 
+        // '>' replaces what was there
+        if (!append_mode && output_vnode->is_file()) {
+            output_vnode->truncate(0);
+        }
+
         redirect_data->output_file = output_vnode;
         redirect_data->offset = append_mode ? output_vnode->size_in_bytes() : 0;
+        redirect_data->append = append_mode;
         me->redirection = redirect_data;
     }
 
@@ -1,6 +1,8 @@
 #include "stdint.h"
 #include "debug.h"
 #include "config.h"
+#include "machine.h"
+#include "init.h"
 
 struct MemInfo {
     uint16_t ax;
@@ -117,10 +119,23 @@ static uint32_t memAbove1M() {
 
 }
 
+static uint32_t cmos(uint32_t reg) {
+    outb(0x70,reg);
+    return inb(0x71);
+}
+
+// E801 stops at 4GB. QEMU (like Bochs) reports the rest in CMOS
+// registers 0x5b..0x5d, in 64KB units
+static uint64_t memAbove4G() {
+    uint64_t chunks = cmos(0x5b) | (cmos(0x5c) << 8) | (cmos(0x5d) << 16);
+    return chunks << 16;
+}
+
 Config kConfig;
 
 void configInit(Config* config) {
     config->memSize = memAbove1M() + (1 << 20);
+    config->highMemSize = onHypervisor ? memAbove4G() : 0;
     RSD* rsdp = findRSD();
     //Debug::printf("found rsd %x\n",(uint32_t)rsdp);
     if (rsdp != 0) {
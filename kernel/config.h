@@ -15,6 +15,7 @@ typedef struct ApicInfo ApicInfo;
 
 struct Config {
     uint32_t memSize;
+    uint64_t highMemSize;   // above 4GB
     uint32_t nOtherProcs;
     uint32_t totalProcs;
     uint32_t localAPIC;
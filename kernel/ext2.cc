@@ -1,4 +1,9 @@
 #include "ext2.h"
+#include "htree.h"
+#include "journal.h"
+#include "bcache.h"
+#include "mount.h"
+#include "blocking_lock.h"
 
 uint32_t divisionRoundUp(uint32_t numerator, uint32_t denominator) { 
     return (numerator + denominator - 1) / denominator;
@@ -14,20 +19,368 @@ bool strEquals(const char *fileName, char *curName, uint8_t curNameLength) {
     return i == curNameLength && fileName[i] == 0;
 }
 
-Ext2::Ext2(Shared<Ide> ide) {
+//
+// The i-node cache
+//
+// One Node per i-node, shared by everybody who uses it. The cache holds a
+// reference on each node (like the buffer cache does on buffers) so a
+// node with ref_count == 1 is idle. Idle nodes past MAX_IDLE get evicted,
+// least recently used first, and written back if they changed.
+//
+struct NodeCache {
+    constexpr static uint32_t NBUCKETS = 256;
+    constexpr static uint32_t MAX_NODES = 512;
+
+    BlockingLock lock{};
+    Node* buckets[NBUCKETS] = {};
+    Node* lruHead = nullptr;      // most recently used
+    Node* lruTail = nullptr;
+    uint32_t count = 0;
+
+    static uint32_t hash(uint32_t number) {
+        return number * 2654435761u % NBUCKETS;
+    }
+
+    // call with the lock held
+    void unlink(Node* node) {
+        auto pp = &buckets[hash(node->number)];
+        while (*pp != node) pp = &(*pp)->hashNext;
+        *pp = node->hashNext;
+        node->hashNext = nullptr;
+
+        if (node->lruPrev == nullptr) lruHead = node->lruNext; else node->lruPrev->lruNext = node->lruNext;
+        if (node->lruNext == nullptr) lruTail = node->lruPrev; else node->lruNext->lruPrev = node->lruPrev;
+        node->lruPrev = nullptr;
+        node->lruNext = nullptr;
+        count -= 1;
+    }
+
+    // call with the lock held
+    void to_front(Node* node) {
+        if (lruHead == node) return;
+        if (node->lruPrev != nullptr) node->lruPrev->lruNext = node->lruNext;
+        if (node->lruNext != nullptr) node->lruNext->lruPrev = node->lruPrev;
+        if (lruTail == node) lruTail = node->lruPrev;
+        node->lruPrev = nullptr;
+        node->lruNext = lruHead;
+        if (lruHead != nullptr) lruHead->lruPrev = node;
+        lruHead = node;
+        if (lruTail == nullptr) lruTail = node;
+    }
+
+    // call with the lock held
+    Node* lookup(uint32_t number) {
+        for (auto node = buckets[hash(number)]; node != nullptr; node = node->hashNext) {
+            if (node->number == number) return node;
+        }
+        return nullptr;
+    }
+
+    // call with the lock held
+    void insert(Node* node) {
+        node->ref_count.add_fetch(1);    // the cache's reference
+        auto& bucket = buckets[hash(node->number)];
+        node->hashNext = bucket;
+        bucket = node;
+        count += 1;
+        to_front(node);
+    }
+
+    // Takes idle nodes out, least recently used first, until we're back
+    // under MAX_NODES. Returns them chained through hashNext
+    Node* evict() {
+        Node* victims = nullptr;
+        auto node = lruTail;
+        while ((count > MAX_NODES) && (node != nullptr)) {
+            auto prev = node->lruPrev;
+            if (node->ref_count.get() == 1) {
+                unlink(node);
+                node->hashNext = victims;
+                victims = node;
+            }
+            node = prev;
+        }
+        return victims;
+    }
+};
+
+//
+// The directory entry cache
+//
+// Remembers what names resolved to, (directory i-number, name) -> i-number,
+// and also the names that weren't there (i-number 0) so looking for a
+// missing program doesn't scan the directory again. Short names only.
+//
+// createNode adds the new name, freeInode forgets everything that
+// mentions the i-node (as a directory or as what a name points to). Entries
+// are also chained by parent and by child i-number so that doesn't have to
+// look at all of them.
+//
+struct DentryCache {
+    constexpr static uint32_t NBUCKETS = 512;
+    constexpr static uint32_t NENTRIES = 1024;
+    constexpr static uint32_t NAME_MAX = 27;
+
+    struct Entry {
+        uint32_t parent = 0;      // 0 -> not in use
+        uint32_t child = 0;       // 0 -> the name isn't there
+        uint8_t length = 0;
+        char name[NAME_MAX];
+        Entry* hashNext = nullptr;
+        Entry* parentNext = nullptr;
+        Entry* childNext = nullptr;
+        Entry* lruPrev = nullptr;
+        Entry* lruNext = nullptr;
+    };
+
+    InterruptSafeLock lock{};
+    Entry entries[NENTRIES];
+    Entry* buckets[NBUCKETS] = {};
+    Entry* parents[NBUCKETS] = {};    // by parent
+    Entry* children[NBUCKETS] = {};   // by child, names that are there
+    Entry* lruHead = nullptr;     // unused entries are at the tail
+    Entry* lruTail = nullptr;
+
+    DentryCache() {
+        for (uint32_t i = 0; i < NENTRIES; i++) {
+            entries[i].lruPrev = (i == 0) ? nullptr : &entries[i - 1];
+            entries[i].lruNext = (i == NENTRIES - 1) ? nullptr : &entries[i + 1];
+        }
+        lruHead = &entries[0];
+        lruTail = &entries[NENTRIES - 1];
+    }
+
+    static uint32_t hash(uint32_t parent, const char* name, uint32_t length) {
+        uint32_t h = 2166136261u ^ parent;
+        for (uint32_t i = 0; i < length; i++) {
+            h = (h ^ uint8_t(name[i])) * 16777619u;
+        }
+        return h % NBUCKETS;
+    }
+
+    // call with the lock held
+    void lru_remove(Entry* e) {
+        if (e->lruPrev == nullptr) lruHead = e->lruNext; else e->lruPrev->lruNext = e->lruNext;
+        if (e->lruNext == nullptr) lruTail = e->lruPrev; else e->lruNext->lruPrev = e->lruPrev;
+    }
+
+    void to_front(Entry* e) {
+        lru_remove(e);
+        e->lruPrev = nullptr;
+        e->lruNext = lruHead;
+        if (lruHead != nullptr) lruHead->lruPrev = e;
+        lruHead = e;
+        if (lruTail == nullptr) lruTail = e;
+    }
+
+    void to_back(Entry* e) {
+        lru_remove(e);
+        e->lruNext = nullptr;
+        e->lruPrev = lruTail;
+        if (lruTail != nullptr) lruTail->lruNext = e;
+        lruTail = e;
+        if (lruHead == nullptr) lruHead = e;
+    }
+
+    Entry* lookup(uint32_t parent, const char* name, uint32_t length) {
+        for (auto e = buckets[hash(parent,name,length)]; e != nullptr; e = e->hashNext) {
+            if ((e->parent != parent) || (e->length != length)) continue;
+            uint32_t i = 0;
+            while ((i < length) && (e->name[i] == name[i])) i++;
+            if (i == length) return e;
+        }
+        return nullptr;
+    }
+
+    void set_child(Entry* e, uint32_t child) {
+        if (e->child != 0) {
+            auto pp = &children[e->child % NBUCKETS];
+            while (*pp != e) pp = &(*pp)->childNext;
+            *pp = e->childNext;
+            e->childNext = nullptr;
+        }
+        e->child = child;
+        if (child != 0) {
+            e->childNext = children[child % NBUCKETS];
+            children[child % NBUCKETS] = e;
+        }
+    }
+
+    // takes it out of its chains and puts it at the back for reuse
+    void drop(Entry* e) {
+        auto pp = &buckets[hash(e->parent,e->name,e->length)];
+        while (*pp != e) pp = &(*pp)->hashNext;
+        *pp = e->hashNext;
+        e->hashNext = nullptr;
+        pp = &parents[e->parent % NBUCKETS];
+        while (*pp != e) pp = &(*pp)->parentNext;
+        *pp = e->parentNext;
+        e->parentNext = nullptr;
+        set_child(e,0);
+        e->parent = 0;
+        to_back(e);
+    }
+
+    // true (and the i-number in "child") if we know
+    bool get(uint32_t parent, const char* name, uint32_t& child) {
+        uint32_t length = K::strlen(name);
+        if (length > NAME_MAX) return false;
+        LockGuard g{lock};
+        auto e = lookup(parent,name,length);
+        if (e == nullptr) return false;
+        to_front(e);
+        child = e->child;
+        return true;
+    }
+
+    void put(uint32_t parent, const char* name, uint32_t child) {
+        uint32_t length = K::strlen(name);
+        if (length > NAME_MAX) return;
+        LockGuard g{lock};
+        auto e = lookup(parent,name,length);
+        if (e == nullptr) {
+            e = lruTail;
+            if (e->parent != 0) drop(e);
+            e->parent = parent;
+            e->length = length;
+            memcpy(e->name,name,length);
+            auto& bucket = buckets[hash(parent,name,length)];
+            e->hashNext = bucket;
+            bucket = e;
+            e->parentNext = parents[parent % NBUCKETS];
+            parents[parent % NBUCKETS] = e;
+        }
+        set_child(e,child);
+        to_front(e);
+    }
+
+    // the i-node is gone, so are its names and the names in it
+    void forget(uint32_t number) {
+        LockGuard g{lock};
+        for (auto e = parents[number % NBUCKETS]; e != nullptr; ) {
+            auto next = e->parentNext;
+            if (e->parent == number) drop(e);
+            e = next;
+        }
+        for (auto e = children[number % NBUCKETS]; e != nullptr; ) {
+            auto next = e->childNext;
+            if (e->child == number) drop(e);
+            e = next;
+        }
+    }
+};
+
+//
+// Block and i-node allocation
+//
+// The bitmaps are read at mount and stay in memory. They are scanned a
+// word at a time and groups with nothing free (going by the counts in
+// their descriptors) are skipped. Each kind remembers where its last
+// allocation was and the next search starts there, so a nearly full
+// volume isn't rescanned from the start every time.
+//
+// Bit i of a group is bit i % 8 of byte i / 8, the first block bit is
+// for block firstDataBlock. Changes stay in memory, each group remembers
+// what it has to write back (the bitmaps, its descriptor) and
+// Ext2::write_metadata writes it all in one go: a run of allocations
+// costs one copy of each bitmap, the descriptor table and the superblock
+// counts instead of all three for every block.
+//
+struct Allocator {
+    constexpr static uint8_t BLOCK_BITMAP = 1;
+    constexpr static uint8_t INODE_BITMAP = 2;
+    constexpr static uint8_t DESCRIPTOR = 4;
+
+    BlockingLock lock{};
+    uint32_t blockHint = 0;     // bit index (across groups) to start at
+    uint32_t inodeHint = 0;
+    uint32_t nextSpread = 0;    // for top level directories
+
+    uint8_t* dirty = nullptr;   // per group, what changed
+    bool superDirty = false;    // the free counts in the superblock
+};
+
+//
+// The block map of a node
+//
+// Past the 12 direct blocks, finding a data block means going through
+// one, two or three levels of pointer blocks. The map keeps the last
+// pointer block it used at each level pinned in the buffer cache, so a
+// run of lookups (reading or writing a big file) goes through memory and
+// a data block costs one I/O instead of one per level.
+//
+// Slot 0 has the pointer block right above the data, slot 1 the one
+// above that, and so on. Changes go through the buffer cache so the
+// pinned copies never go stale.
+//
+// New blocks go right after the last one we allocated (or the block
+// before them in the file, or the start of the i-node's group). A file
+// that grows also gets a preallocation window: the free blocks after the
+// one it asked for are taken out of the bitmap too and handed out as it
+// keeps appending, so two files written at the same time don't
+// interleave their blocks. Whatever is left of the window goes back
+// when the node is evicted, synced with the volume or deleted.
+//
+struct BlockMap {
+    constexpr static uint32_t LEVELS = 3;
+    constexpr static uint32_t PREALLOC = 8;
+
+    BlockingLock lock{};
+    uint32_t pinned[LEVELS] = {};    // the disk block in each slot, 0 for none
+    BlockRef refs[LEVELS];
+
+    uint32_t lastLogical = 0;       // the last data block we allocated
+    uint32_t lastPhysical = 0;      // the last block we allocated, 0 for none
+    uint32_t preallocNext = 0;
+    uint32_t preallocCount = 0;
+
+    // the pointers in disk block "block", call with the lock held
+    const uint32_t* pointers(Ext2* fs, uint32_t slot, uint32_t block) {
+        if (pinned[slot] != block) {
+            refs[slot].pin(fs, block);
+            pinned[slot] = block;
+        }
+        return (const uint32_t*) refs[slot].data;
+    }
+
+    // The rest are called with the lock held
+
+    // disk block of the given block of "node" (see Node::block_address)
+    uint32_t lookup(Node* node, uint32_t blockNumber, bool allocate);
+
+    // where we'd like the next block for "blockNumber" to go
+    uint32_t goal(Node* node, uint32_t blockNumber);
+
+    // a new block for "blockNumber" (or a pointer block on the way to it),
+    // 0 if the volume is full
+    uint32_t take(Node* node, uint32_t blockNumber, bool pointers);
+
+    // frees what's left of the window
+    void discard(Node* node);
+};
+
+Ext2::Ext2(Shared<BlockIO> dev) {
     // initialize super block
-    this->ide = ide;
+    this->dev = dev;
     this->superBlock = new SuperBlock();
+    this->nodes = new NodeCache();
+    this->dentries = new DentryCache();
+    this->allocator = new Allocator();
 
-    this->ide->read_all(1024, 1024, (char *) superBlock);
+    this->read_all(1024, 1024, (char *) superBlock);
 
     // initialize block group table
-    // starts at block 1 for any block size greater than 1024
-    // block size of 1024 -> starts at block 2
-    uint32_t blockGroupTableAddress = get_block_size() == 1024 ? 2 * get_block_size() : get_block_size();
-    this->numBlockGroups = divisionRoundUp(this->superBlock->totalBlocks, this->superBlock->blocksPerGroup);
+    // in the block after the superblock's: block 2 for 1K blocks, block 1 otherwise
+    uint32_t blockGroupTableAddress = (superBlock->firstDataBlock + 1) * get_block_size();
+    this->numBlockGroups = divisionRoundUp(superBlock->totalBlocks - superBlock->firstDataBlock, superBlock->blocksPerGroup);
     this->blockGroupTable = new BlockGroupDescriptor[numBlockGroups];
-    this->ide->read_all(blockGroupTableAddress, numBlockGroups * 32, (char *) blockGroupTable);
+    this->read_all(blockGroupTableAddress, numBlockGroups * 32, (char *) blockGroupTable);
+
+    // replays what the journal has (and reads the above again), the
+    // bitmaps come after that
+    if (superBlock->featureCompat & FEATURE_HAS_JOURNAL) {
+        this->journal = Journal::open(this);
+    }
 
     // initialize inode and block bitmaps
     this->inodeUsageBitmaps = new char*[numBlockGroups];
@@ -35,37 +388,188 @@ Ext2::Ext2(Shared<Ide> ide) {
     for (uint32_t i = 0; i < numBlockGroups; i++) {
         // initialize inode bitmap
         this->inodeUsageBitmaps[i] = new char[get_block_size()];
-        this->ide->read_all(blockGroupTable[i].inodeUsageAddress * get_block_size(), get_block_size(), inodeUsageBitmaps[i]);
+        this->read_all(blockGroupTable[i].inodeUsageAddress * get_block_size(), get_block_size(), inodeUsageBitmaps[i]);
 
         // initialize block bitmap
         this->blockUsageBitmaps[i] = new char[get_block_size()];
-        this->ide->read_all(blockGroupTable[i].blockUsageAddress * get_block_size(), get_block_size(), blockUsageBitmaps[i]);
+        this->read_all(blockGroupTable[i].blockUsageAddress * get_block_size(), get_block_size(), blockUsageBitmaps[i]);
     }  
+    this->allocator->dirty = new uint8_t[numBlockGroups];
+    bzero(allocator->dirty, numBlockGroups);
 
     // initialize root directory inode
-    this->root = new Node(get_block_size(), 2, this); // root inode number is 2
-}
-
-int Ext2::findAvailableStructure(uint32_t startingNumber, char **usageBitmaps, uint32_t structuresPerGroup) {
-    uint32_t curNumber = startingNumber;
-    uint32_t bytesPerBitmap = structuresPerGroup / 8;
-
-    for (uint32_t curBlockGroup = 0; curBlockGroup < numBlockGroups; curBlockGroup++) {
-        char *usageBitmap = usageBitmaps[curBlockGroup];
-        for (uint32_t curByte = 0; curByte < bytesPerBitmap; curByte++) {
-            // iterate over each bit
-            for (int bitShift = 7; bitShift >= 0; bitShift--) {
-                uint32_t curBit = (usageBitmap[curByte] >> bitShift) & 1;
-                // check if structure is allocated
-                if (!curBit) {
-                    uint32_t bitMask = 1 << bitShift;
-                    // allocate structure
-                    usageBitmap[curByte] |= bitMask;
-                    // blockGroupTable[curBlockGroup].availableInodes--;
-                    return curNumber;
+    this->root = get_node(2); // root inode number is 2
+}
+
+Node::Node(uint32_t block_size, uint32_t number, Ext2 *fileSystem) : BlockIO(block_size), number(number) {
+    uint32_t blockGroup = (number - 1) / fileSystem->superBlock->inodesPerGroup;
+    uint32_t inodeIndex = (number - 1) % fileSystem->superBlock->inodesPerGroup;
+
+    char *inode = new char[128];
+    uint32_t byteInodeTableAddress = fileSystem->blockGroupTable[blockGroup].inodeTableAddress * block_size;
+    uint32_t inodeOffset = byteInodeTableAddress + inodeIndex * 128;
+
+    fileSystem->read_all(inodeOffset, 128, inode);
+
+    this->inode = (Inode *) inode;
+    this->type = this->inode->typesAndPermissions & 0xF000;
+    this->fileSystem = fileSystem;
+    this->map = new BlockMap();
+}
+
+Node::~Node() {
+    delete map;
+    delete[] (char*) inode;
+}
+
+bool Ext2::probe(BlockIO* dev) {
+    // missing drives have no size
+    if (dev->size_in_bytes() < 2048) return false;
+    uint16_t magic;
+    dev->read(1024 + 56, magic);
+    if (magic != 0xEF53) return false;
+
+    // disk addresses are 32 bits, a bigger volume would wrap around
+    uint32_t totalBlocks;
+    uint32_t blockSizeShift;
+    dev->read(1024 + 4, totalBlocks);
+    dev->read(1024 + 24, blockSizeShift);
+    // BlockRef hands out blocks inside one cache block, so a file system
+    // block can't be bigger than that
+    if ((blockSizeShift > 6) || ((1024u << blockSizeShift) > BCache::BLOCK_SIZE)) {
+        Debug::printf("| ext2: %d byte blocks are bigger than the cache's\n", 1024 << K::min(blockSizeShift, 6u));
+        return false;
+    }
+    uint64_t bytes = uint64_t(totalBlocks) * (1024 << blockSizeShift);
+    if ((bytes > 0xFFFFFFFF) || (bytes > dev->size_in_bytes())) {
+        Debug::printf("| ext2: a %d block volume doesn't fit in 4GB or on its drive\n", totalBlocks);
+        return false;
+    }
+    return true;
+}
+
+void Ext2::read_all(uint32_t diskOffset, uint32_t bytesToRead, char *buffer) {
+    BCache::read(dev.ptr, diskOffset, bytesToRead, buffer);
+}
+
+void Ext2::write_all(uint32_t diskOffset, char *bufferToWrite, uint32_t bytesToWrite) {
+    BCache::write(dev.ptr, diskOffset, bufferToWrite, bytesToWrite);
+}
+
+void Ext2::log_all(uint32_t diskOffset, char *bufferToWrite, uint32_t bytesToWrite) {
+    if ((journal != nullptr) && (bytesToWrite > 0)) {
+        // held before they change so the old contents are all that can go home
+        auto bs = get_block_size();
+        for (uint32_t block = diskOffset / bs; block <= (diskOffset + bytesToWrite - 1) / bs; block++) {
+            journal->log(block);
+        }
+    }
+    write_all(diskOffset, bufferToWrite, bytesToWrite);
+}
+
+void Ext2::prefetch(uint32_t diskOffset, uint32_t n) {
+    BCache::prefetch(dev.ptr, diskOffset, n);
+}
+
+void Ext2::write_back(bool discard) {
+    if (journal != nullptr) {
+        journal->commit(discard);
+    } else {
+        write_dirty(discard);
+    }
+}
+
+void Ext2::write_dirty(bool discard) {
+    // the i-nodes go to the buffer cache first
+    uint32_t n = 0;
+    Shared<Node>* dirty;
+    while (true) {
+        auto size = nodes->count;
+        dirty = new Shared<Node>[size];
+        {
+            LockGuard g{nodes->lock};
+            if (nodes->count <= size) {
+                for (auto node = nodes->lruHead; node != nullptr; node = node->lruNext) {
+                    if (node->dirty || (discard && (node->map->preallocCount != 0))) dirty[n++] = node;
                 }
-                curNumber++;
+                break;
+            }
+        }
+        delete[] dirty;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (discard) dirty[i]->discard_prealloc();
+        write_node(dirty[i].ptr);
+    }
+    delete[] dirty;
+
+    // after the nodes, discarding gives blocks back
+    write_metadata();
+}
+
+void Ext2::sync() {
+    write_back(true);
+    BCache::sync(dev.ptr);
+}
+
+void Ext2::unmount() {
+    sync();
+    if (journal != nullptr) journal->close();
+}
+
+void Ext2::sync(uint32_t diskOffset, uint32_t n) {
+    BCache::sync(dev.ptr, diskOffset, n);
+}
+
+int Ext2::findAvailableStructure(bool inodes, uint32_t start, uint32_t maxRun, uint32_t* run) {
+    auto perGroup = inodes ? superBlock->inodesPerGroup : superBlock->blocksPerGroup;
+    auto total = inodes ? superBlock->totalInodes : superBlock->totalBlocks - superBlock->firstDataBlock;
+    auto bitmaps = inodes ? inodeUsageBitmaps : blockUsageBitmaps;
+    if (start >= total) start = 0;
+
+    LockGuard g{allocator->lock};
+
+    // the starting group comes around again at the end for the bits
+    // before "start"
+    uint32_t first = start / perGroup;
+    for (uint32_t i = 0; i <= numBlockGroups; i++) {
+        uint32_t group = (first + i) % numBlockGroups;
+        auto& desc = blockGroupTable[group];
+        if ((inodes ? desc.availableInodes : desc.availableBlocks) == 0) continue;
+
+        uint32_t bits = K::min(perGroup, total - group * perGroup);
+        uint32_t from = (i == 0) ? start % perGroup : 0;
+        auto words = (uint32_t*) bitmaps[group];
+        uint32_t mask = ~0u << (from % 32);
+        for (uint32_t w = from / 32; w * 32 < bits; w++, mask = ~0u) {
+            uint32_t clear = ~words[w] & mask;
+            if (clear == 0) continue;
+            uint32_t bit = w * 32 + __builtin_ctz(clear);
+            if (bit >= bits) break;
+
+            // and the clear bits that follow, as many as we're allowed
+            uint32_t n = 0;
+            while ((n < maxRun) && (bit + n < bits)) {
+                auto& word = words[(bit + n) / 32];
+                uint32_t mask = 1u << ((bit + n) % 32);
+                if (word & mask) break;
+                word |= mask;
+                n += 1;
             }
+
+            if (inodes) {
+                desc.availableInodes -= n;
+                superBlock->freeInodes -= n;
+            } else {
+                desc.availableBlocks -= n;
+                superBlock->freeBlocks -= n;
+            }
+            dirtyAllocation(inodes, group);
+
+            uint32_t index = group * perGroup + bit;
+            (inodes ? allocator->inodeHint : allocator->blockHint) = index + n;
+            if (run != nullptr) *run = n;
+            return index;
         }
     }
 
@@ -73,67 +577,242 @@ int Ext2::findAvailableStructure(uint32_t startingNumber, char **usageBitmaps, u
     return -1;
 }
 
-int Ext2::findAvailableBlock() {
-    uint32_t allocatedBlock = findAvailableStructure(0, blockUsageBitmaps, superBlock->blocksPerGroup);
-    return allocatedBlock;
+void Ext2::dirtyAllocation(bool inodes, uint32_t group) {
+    allocator->dirty[group] |= (inodes ? Allocator::INODE_BITMAP : Allocator::BLOCK_BITMAP) | Allocator::DESCRIPTOR;
+    allocator->superDirty = true;
+}
+
+void Ext2::write_metadata() {
+    auto bs = get_block_size();
+    LockGuard g{allocator->lock};
+
+    bool descriptors = false;
+    for (uint32_t group = 0; group < numBlockGroups; group++) {
+        auto what = allocator->dirty[group];
+        if (what == 0) continue;
+        allocator->dirty[group] = 0;
+
+        auto& desc = blockGroupTable[group];
+        if (what & Allocator::BLOCK_BITMAP) log_all(desc.blockUsageAddress * bs, blockUsageBitmaps[group], bs);
+        if (what & Allocator::INODE_BITMAP) log_all(desc.inodeUsageAddress * bs, inodeUsageBitmaps[group], bs);
+        if (what & Allocator::DESCRIPTOR) descriptors = true;
+    }
+
+    // the whole table, it's usually a block or less
+    if (descriptors) {
+        log_all((superBlock->firstDataBlock + 1) * bs, (char*) blockGroupTable, numBlockGroups * sizeof(BlockGroupDescriptor));
+    }
+
+    if (allocator->superDirty) {
+        allocator->superDirty = false;
+        log_all(1024 + 12, (char*) &superBlock->freeBlocks, 8);
+    }
+}
+
+int Ext2::findAvailableBlock(uint32_t goal, uint32_t maxRun, uint32_t* run) {
+    uint32_t start = (goal > superBlock->firstDataBlock) ? goal - superBlock->firstDataBlock : allocator->blockHint;
+    int index = findAvailableStructure(false, start, maxRun, run);
+    return (index < 0) ? -1 : index + superBlock->firstDataBlock;
+}
+
+//
+// Orlov-style placement
+//
+// Directories right under the root get spread over the groups that have
+// more than their share of free i-nodes and blocks (the one with the
+// fewest directories wins) so unrelated trees don't crowd each other.
+// Deeper directories stay in their parent's group while it's not too
+// full. Files go in their directory's group, and their blocks follow
+// (see BlockMap::goal), so a directory and what's in it sit together.
+//
+uint32_t Ext2::findGroupForInode(Node* parent, bool directory) {
+    uint32_t parentGroup = (parent->number - 1) / superBlock->inodesPerGroup;
+    uint32_t avgInodes = superBlock->freeInodes / numBlockGroups;
+    uint32_t avgBlocks = superBlock->freeBlocks / numBlockGroups;
+
+    if (!directory) {
+        for (uint32_t i = 0; i < numBlockGroups; i++) {
+            auto group = (parentGroup + i) % numBlockGroups;
+            auto& desc = blockGroupTable[group];
+            if ((desc.availableInodes > 0) && (desc.availableBlocks > 0)) return group;
+        }
+        return parentGroup;
+    }
+
+    if (parent->number == 2) {
+        // start somewhere different every time so ties don't all go to one group
+        uint32_t start = allocator->nextSpread++ % numBlockGroups;
+        uint32_t best = numBlockGroups;
+        for (uint32_t i = 0; i < numBlockGroups; i++) {
+            auto group = (start + i) % numBlockGroups;
+            auto& desc = blockGroupTable[group];
+            if ((desc.availableInodes < avgInodes) || (desc.availableBlocks < avgBlocks)) continue;
+            if ((best == numBlockGroups) || (desc.usedDirs < blockGroupTable[best].usedDirs)) best = group;
+        }
+        if (best != numBlockGroups) return best;
+    } else {
+        uint32_t dirs = 0;
+        for (uint32_t i = 0; i < numBlockGroups; i++) dirs += blockGroupTable[i].usedDirs;
+        uint32_t maxDirs = dirs / numBlockGroups + superBlock->inodesPerGroup / 16;
+        uint32_t minInodes = avgInodes - avgInodes / 4;
+        uint32_t minBlocks = avgBlocks - avgBlocks / 4;
+        for (uint32_t i = 0; i < numBlockGroups; i++) {
+            auto group = (parentGroup + i) % numBlockGroups;
+            auto& desc = blockGroupTable[group];
+            if ((desc.usedDirs < maxDirs) && (desc.availableInodes >= minInodes) && (desc.availableBlocks >= minBlocks)) {
+                return group;
+            }
+        }
+    }
+
+    // no group is good, take one with room
+    for (uint32_t i = 0; i < numBlockGroups; i++) {
+        auto group = (parentGroup + i) % numBlockGroups;
+        if (blockGroupTable[group].availableInodes >= K::max(avgInodes, uint32_t(1))) return group;
+    }
+    return parentGroup;
 }
 
 // return inodeNumber
-int Ext2::findAvailableInode() {
-    uint32_t allocatedInode = findAvailableStructure(1, inodeUsageBitmaps, superBlock->inodesPerGroup);
-    return allocatedInode;
+int Ext2::findAvailableInode(Node* parent, bool directory) {
+    uint32_t group = findGroupForInode(parent, directory);
+    int index = findAvailableStructure(true, group * superBlock->inodesPerGroup);
+    if (index < 0) return -1;
+    if (directory) countDirectory(index + 1, 1);
+    return index + 1;
 }
 
-void Ext2::freeStructure(uint32_t number, char **usageBitmaps, uint32_t structuresPerGroup) {
-    uint32_t groupNumber = number / structuresPerGroup;
-    uint32_t groupBitNumber = number % structuresPerGroup;
-    uint32_t byteIndex = groupBitNumber / 8;
-    uint32_t bitIndex = groupBitNumber % 8;
+void Ext2::countDirectory(uint32_t inodeNumber, int delta) {
+    uint32_t group = (inodeNumber - 1) / superBlock->inodesPerGroup;
+    LockGuard g{allocator->lock};
+    blockGroupTable[group].usedDirs += delta;
+    allocator->dirty[group] |= Allocator::DESCRIPTOR;
+}
+
+void Ext2::freeStructure(bool inodes, uint32_t index) {
+    auto perGroup = inodes ? superBlock->inodesPerGroup : superBlock->blocksPerGroup;
+    auto bitmaps = inodes ? inodeUsageBitmaps : blockUsageBitmaps;
+    uint32_t group = index / perGroup;
+    uint32_t bit = index % perGroup;
+    ASSERT(group < numBlockGroups);
+
+    LockGuard g{allocator->lock};
+
+    auto words = (uint32_t*) bitmaps[group];
+    uint32_t mask = 1u << (bit % 32);
+    if ((words[bit / 32] & mask) == 0) {
+        Debug::printf("ext2: freeing %s %d twice\n", inodes ? "i-node" : "block", index);
+        return;
+    }
+    words[bit / 32] &= ~mask;
 
-    // free the desired bit by masking it out while preserving the rest of the byte
-    char *usageBitmap = usageBitmaps[groupNumber];
-    uint32_t bitMask = ~(1 << (7 - bitIndex));
-    usageBitmap[byteIndex] &= bitMask;
+    auto& desc = blockGroupTable[group];
+    if (inodes) {
+        desc.availableInodes += 1;
+        superBlock->freeInodes += 1;
+    } else {
+        desc.availableBlocks += 1;
+        superBlock->freeBlocks += 1;
+    }
+    dirtyAllocation(inodes, group);
 }
 
 void Ext2::freeBlock(uint32_t blockNumber) {
-    return freeStructure(blockNumber, blockUsageBitmaps, superBlock->blocksPerGroup);
+    // the journal mustn't put old metadata over whatever it becomes
+    if (journal != nullptr) journal->revoke(blockNumber);
+    return freeStructure(false, blockNumber - superBlock->firstDataBlock);
 } 
 
-void Ext2::freeInode(uint32_t inodeNumber) {
-    return freeStructure(inodeNumber - 1, inodeUsageBitmaps, superBlock->inodesPerGroup);
+void Ext2::freeInode(uint32_t inodeNumber, bool directory) {
+    dentries->forget(inodeNumber);
+
+    // the number can come back as a different file, forget the old one
+    Node* gone;
+    {
+        LockGuard g{nodes->lock};
+        gone = nodes->lookup(inodeNumber);
+        if (gone != nullptr) nodes->unlink(gone);
+    }
+    if (gone != nullptr) {
+        gone->dirty = false;
+        if (gone->ref_count.add_fetch(-1) == 0) delete gone;
+    }
+
+    if (directory) countDirectory(inodeNumber, -1);
+    return freeStructure(true, inodeNumber - 1);
 }
 
-void Ext2::createInode(uint16_t fileType, int inodeNumber) {
+Shared<Node> Ext2::createInode(uint16_t fileType, int inodeNumber) {
     if (inodeNumber < 1) {
         Debug::panic("Invalid inode number!");
     }
 
-    char buffer[128];
-    char *inodeData = buffer;
-
-    // read in types and permissions
-    *((uint16_t *) inodeData) = fileType;
-    inodeData += 4;
+    // whatever the table had is left over from a deleted file, the new
+    // i-node goes back with the rest of the node cache
+    auto node = get_node(inodeNumber);
+    bzero(node->inode, sizeof(Inode));
+    node->inode->typesAndPermissions = fileType;
+    // brand new, so one link
+    node->inode->numHardLinks = 1;
+    node->type = fileType & 0xF000;
+    node->dirty = true;
+    return node;
+}
 
-    // read in inode size
-    *((uint32_t *) inodeData) = 0;
-    inodeData += 22;
+void createDirectoryEntry(const char* name, int inodeNumber, uint8_t typeIndicator, Shared<Node> dir) {
+    uint32_t nameLength = K::strlen(name);
+    uint32_t blockSize = dir->block_size;
+    auto fs = dir->fileSystem;
 
-    // read in numHardLinks - should be one as we are creating brand new file
-    *((uint16_t *) inodeData) = 1;
-    inodeData += 14;
+    auto unindex = [&dir] {
+        // the entries are all still there, a linear scan finds them
+        dir->inode->flags &= ~INODE_INDEX_FL;
+        dir->dirty = true;
+    };
 
-    // zero out all block addresses - mark as invalid for empty inode
-    for (uint32_t blockIndex = 0; blockIndex < 15; blockIndex++) {
-        ((uint32_t *) inodeData)[blockIndex] = 0;
+    if (HTree::indexed(dir.ptr)) {
+        if (HTree::add(dir.ptr, name, nameLength, inodeNumber, typeIndicator)) return;
+        unindex();
     }
 
-    write_all(getInodeTableOffset(inodeNumber), buffer, 128);
-}
+    if (dir->size_in_bytes() % blockSize == 0) {
+        // the first gap that is big enough, the blocks are looked at in
+        // the cache and only the one that gets the entry is copied
+        uint32_t n = dir->size_in_bytes() / blockSize;
+        BlockRef ref{};
+        for (uint32_t i = 0; i < n; i++) {
+            auto address = dir->block_address(i);
+            if (address == 0) break;      // directories have no holes
+            ref.pin(fs, address);
+            if (HTree::has_room(ref.data, blockSize, nameLength)) {
+                auto block = new char[blockSize];
+                memcpy(block, ref.data, blockSize);
+                ref.release();
+                HTree::put_entry(block, blockSize, name, nameLength, inodeNumber, typeIndicator);
+                dir->write_all(i * blockSize, block, blockSize);
+                delete[] block;
+                return;
+            }
+        }
+        ref.release();
 
-void createDirectoryEntry(const char* name, int inodeNumber, uint8_t typeIndicator, Shared<Node> dir) {
-    uint32_t nameLength = K::strlen(name);
+        // a directory gets an index when it outgrows its first block
+        if ((n == 1) && (fs->superBlock->featureCompat & FEATURE_DIR_INDEX) && HTree::make_indexed(dir.ptr)) {
+            if (HTree::add(dir.ptr, name, nameLength, inodeNumber, typeIndicator)) return;
+            unindex();
+        }
+
+        // a new block with just this entry
+        auto block = new char[blockSize];
+        bzero(block, blockSize);
+        *((uint16_t *) (block + 4)) = blockSize;
+        HTree::put_entry(block, blockSize, name, nameLength, inodeNumber, typeIndicator);
+        dir->write_all(dir->size_in_bytes(), block, blockSize);
+        delete[] block;
+        return;
+    }
+
+    // directories we used to pack without regard for blocks, keep appending
     uint32_t directorySize = 8 + nameLength;
     // ensure directory entry is 4 byte aligned
     if (directorySize % 4 != 0) {
@@ -168,7 +847,8 @@ void createDirectoryEntry(const char* name, int inodeNumber, uint8_t typeIndicat
 
 // make it so zerored out directory entries just have inode number of zero
 bool Ext2::createNode(Shared<Node> dir, const char* name, uint8_t typeIndicator) {
-    int inodeNumber = findAvailableInode();
+    Handle h{this};
+    int inodeNumber = findAvailableInode(dir.ptr, typeIndicator == ENTRY_DIRECTORY_TYPE);
     // we ran out of inodes!
     if (inodeNumber == -1) {
         return false;
@@ -181,11 +861,11 @@ bool Ext2::createNode(Shared<Node> dir, const char* name, uint8_t typeIndicator)
         fileType = 0xA000;
     }
 
-    createInode(fileType, inodeNumber);
+    Shared<Node> newNode = createInode(fileType, inodeNumber);
     createDirectoryEntry(name, inodeNumber, typeIndicator, dir);
+    dentries->put(dir->number, name, inodeNumber);
 
     if (typeIndicator == ENTRY_DIRECTORY_TYPE) {
-        Shared<Node> newNode = get_node(inodeNumber  );
         char buffer[3];
         char *fileName = buffer;
         fileName[0] = '.';
@@ -200,24 +880,54 @@ bool Ext2::createNode(Shared<Node> dir, const char* name, uint8_t typeIndicator)
 }
 
 Shared<Node> Ext2::get_node(uint32_t number) {
-    // ASSERT(number > 0);
-    // ASSERT(number <= superBlock->inodesPerGroup);
-    // auto index = number - 1;
-
-    // auto groupIndex = index / superBlock->inodesPerGroup;
-    // //Debug::printf("groupIndex %d\n",groupIndex);
-    // ASSERT(groupIndex < numBlockGroups);
-    // auto indexInGroup = index % superBlock->inodesPerGroup;
-    // auto iTableBase = blockGroupTable[groupIndex].inodeTableAddress;
-    // // ASSERT(iTableBase <= numberOfBlocks);
-    // auto nodeOffset = iTableBase * get_block_size() + indexInGroup * get_inode_size();
-
-    // Debug::printf("I made it here bro\n");
-    // auto out = Shared<Node>::make(get_block_size(), number, this);
-    // ide->read_all(nodeOffset, 128, (char *) out->inode);
-    Node *node = new Node(get_block_size(), number, this);
-    return Shared<Node>{node};
-    // return out;
+    {
+        LockGuard g{nodes->lock};
+        auto node = nodes->lookup(number);
+        if (node != nullptr) {
+            nodes->to_front(node);
+            return Shared<Node>{node};
+        }
+    }
+
+    // reading the i-node can block, do it without the lock
+    auto fresh = new Node(get_block_size(), number, this);
+    Shared<Node> out{};
+    Node* victims;
+    {
+        LockGuard g{nodes->lock};
+        auto node = nodes->lookup(number);
+        if (node != nullptr) {
+            // somebody beat us to it
+            nodes->to_front(node);
+            out = node;
+        } else {
+            nodes->insert(fresh);
+            out = fresh;
+            fresh = nullptr;
+        }
+        victims = nodes->evict();
+    }
+    if (fresh != nullptr) delete fresh;
+
+    if (victims != nullptr) {
+        Handle h{this};
+        while (victims != nullptr) {
+            auto node = victims;
+            victims = node->hashNext;
+            node->discard_prealloc();
+            write_node(node);
+            // nobody else had it
+            if (node->ref_count.add_fetch(-1) == 0) delete node;
+        }
+    }
+
+    return out;
+}
+
+void Ext2::write_node(Node* node) {
+    if (!node->dirty) return;
+    node->dirty = false;
+    log_all(getInodeTableOffset(node->number), (char*) node->inode, get_inode_size());
 }
 
 // If the given node is a directory, return a reference to the
@@ -245,12 +955,19 @@ Shared<Node> Ext2::find(Shared<Node> current, const char* path) {
             part[i++] = c;
         }
         part[i] = 0;
+        if (K::streq(part,"..")) {
+            // out of a mounted volume, ".." is the parent of what it covers
+            auto over = Mounts::covered(current.ptr);
+            if (over != nullptr) current = over;
+        }
         auto number = current->find(part);
         if (number == 0) {
             current = Shared<Node>{};
             goto done;
         } else {
-            current = get_node(number);
+            // the walk can cross into other volumes, names are looked up
+            // in the file system of the directory that has them
+            current = Mounts::cross(current->fileSystem->get_node(number));
         }
     }
 
@@ -259,26 +976,346 @@ Shared<Node> Ext2::find(Shared<Node> current, const char* path) {
         return current;
 }
 
+void BlockRef::pin(Ext2* fs, uint32_t diskBlock) {
+    // a file system block never spans two cache blocks
+    uint32_t offset = diskBlock * fs->get_block_size();
+    auto b = BCache::get(fs->dev.ptr, offset / BCache::BLOCK_SIZE);
+    release();
+    buffer = b.ptr;
+    b.ptr = nullptr;    // we keep its reference
+    data = buffer->data + offset % BCache::BLOCK_SIZE;
+}
+
+void BlockRef::release() {
+    Shared<Buffer> last{};
+    last.ptr = buffer;  // dropped on the way out
+    buffer = nullptr;
+    data = nullptr;
+}
+
 uint32_t Node::find(const char* name) {
     uint32_t out = 0;
+    if (fileSystem->dentries->get(number, name, out)) return out;
 
-    entries([&out,name](uint32_t number, const char* nm) {
-        if (K::streq(name,nm)) {
+    uint32_t length = K::strlen(name);
+    if (!HTree::indexed(this) || !HTree::find(this, name, length, out)) {
+        entries([&out, name, length](uint32_t number, const char* nm, uint32_t n) {
+            if (n != length) return false;
+            for (uint32_t i = 0; i < n; i++) {
+                if (nm[i] != name[i]) return false;
+            }
             out = number;
+            return true;
+        });
+    }
+
+    fileSystem->dentries->put(number, name, out);
+    return out;
+}
+
+void Node::deleteFromDirectory(uint32_t inodeToDelete, const char* name, uint32_t length) {
+    if (HTree::indexed(this) && HTree::remove(this, name, length, inodeToDelete)) return;
+
+    // one block at a time, a directory can be much bigger than a stack
+    uint32_t at = ~uint32_t(0);
+    entries_at([&at, inodeToDelete, name, length](uint32_t offset, uint32_t number, const char* nm, uint32_t n) {
+        if ((number != inodeToDelete) || (n != length)) return false;
+        for (uint32_t i = 0; i < n; i++) {
+            if (nm[i] != name[i]) return false;
         }
+        at = offset;
+        return true;
     });
+    if (at == ~uint32_t(0)) return;
 
-    return out;
+    // an empty entry, createDirectoryEntry reuses the space
+    uint32_t zero = 0;
+    write_all(at, (char*) &zero, 4);
+}
+
+// Fills a block with zeros (new pointer blocks)
+static void zero_block(Ext2* fs, uint32_t block) {
+    auto bs = fs->get_block_size();
+    auto zeros = new char[bs];
+    bzero(zeros, bs);
+    fs->log_all(block * bs, zeros, bs);
+    delete[] zeros;
+}
+
+uint32_t BlockMap::goal(Node* node, uint32_t blockNumber) {
+    if ((lastPhysical != 0) && (lastLogical + 1 == blockNumber)) return lastPhysical + 1;
+    if (blockNumber > 0) {
+        auto before = lookup(node, blockNumber - 1, false);
+        if (before != 0) return before + 1;
+    }
+    auto sb = node->fileSystem->superBlock;
+    return (node->number - 1) / sb->inodesPerGroup * sb->blocksPerGroup + sb->firstDataBlock;
+}
+
+uint32_t BlockMap::take(Node* node, uint32_t blockNumber, bool pointers) {
+    auto fs = node->fileSystem;
+    auto want = goal(node, blockNumber);
+    uint32_t block;
+
+    if ((preallocCount > 0) && (preallocNext == want)) {
+        block = preallocNext;
+        preallocNext += 1;
+        preallocCount -= 1;
+    } else {
+        discard(node);
+        uint32_t run = 1;
+        int got = fs->findAvailableBlock(want, node->is_file() ? PREALLOC : 1, &run);
+        if (got <= 0) {
+            Debug::printf("| ext2: out of blocks for i-node %d\n", node->number);
+            return 0;
+        }
+        block = got;
+        preallocNext = block + 1;
+        preallocCount = run - 1;
+    }
+
+    if (pointers) zero_block(fs, block);
+    node->inode->sectors += node->block_size / 512;
+    node->dirty = true;
+
+    lastPhysical = block;
+    if (!pointers) lastLogical = blockNumber;
+    return block;
 }
 
+void BlockMap::discard(Node* node) {
+    while (preallocCount > 0) {
+        node->fileSystem->freeBlock(preallocNext);
+        preallocNext += 1;
+        preallocCount -= 1;
+    }
+}
+
+uint32_t BlockMap::lookup(Node* node, uint32_t blockNumber, bool allocate) {
+    auto inode = node->inode;
+    auto fs = node->fileSystem;
+    const uint32_t bs = node->block_size;
+
+    if (blockNumber < 12) {
+        auto& slot = inode->blockAddresses[blockNumber];
+        if ((slot == 0) && allocate) {
+            slot = take(node, blockNumber, false);
+        }
+        return slot;
+    }
+
+    // which tree (single, double, triple) and where in it
+    const uint32_t perBlock = bs / 4;
+    uint32_t n = blockNumber - 12;
+    uint32_t levels = 1;
+    uint32_t span = perBlock;
+    while (n >= span) {
+        n -= span;
+        levels += 1;
+        if (levels > LEVELS) {
+            Debug::panic("ext2: block %d is past the end of a file\n", blockNumber);
+        }
+        span *= perBlock;
+    }
+
+    auto& top = inode->blockAddresses[11 + levels];
+    if (top == 0) {
+        if (!allocate) return 0;
+        auto block = take(node, blockNumber, true);
+        if (block == 0) return 0;
+        top = block;
+    }
+
+    uint32_t block = top;
+    for (uint32_t level = 0; level < levels; level++) {
+        span /= perBlock;
+        uint32_t index = (n / span) % perBlock;
+        bool last = (level + 1 == levels);
+        uint32_t next = pointers(fs, levels - 1 - level, block)[index];
+        if (next == 0) {
+            if (!allocate) return 0;
+            next = take(node, blockNumber, !last);
+            if (next == 0) return 0;
+            fs->log_all(block * bs + index * 4, (char*) &next, 4);
+        }
+        block = next;
+    }
+    return block;
+}
+
+uint32_t Node::block_address(uint32_t blockNumber, bool allocate) {
+    // direct blocks only change with allocate
+    if ((blockNumber < 12) && !allocate) return inode->blockAddresses[blockNumber];
+
+    LockGuard g{map->lock};
+    return map->lookup(this, blockNumber, allocate);
+}
+
+void Node::discard_prealloc() {
+    LockGuard g{map->lock};
+    map->discard(this);
+}
+
+// Calls work(block,isPointerBlock) for "block" and everything under it,
+// children first. "depth" is how many levels of pointers it has below it
+template <typename Work>
+static void walk_tree(Ext2* fs, uint32_t block, uint32_t depth, Work& work) {
+    if (block == 0) return;
+    if (depth > 0) {
+        auto bs = fs->get_block_size();
+        auto pointers = new uint32_t[bs / 4];
+        fs->read_all(block * bs, bs, (char*) pointers);
+        for (uint32_t i = 0; i < bs / 4; i++) {
+            walk_tree(fs, pointers[i], depth - 1, work);
+        }
+        delete[] pointers;
+    }
+    work(block, depth > 0);
+}
+
+// Frees what's under "block" past the first "keep" data blocks of the
+// node. "first" is the first data block under it, "span" how many it can
+// have. Returns true if "block" went too
+static bool trim_tree(Node* node, uint32_t block, uint32_t depth, uint32_t first, uint32_t span, uint32_t keep) {
+    auto fs = node->fileSystem;
+    if (block == 0) return true;
+    if (first + span <= keep) return false;
+
+    if (first >= keep) {
+        auto work = [fs, node](uint32_t b, bool) {
+            fs->freeBlock(b);
+            node->inode->sectors -= node->block_size / 512;
+        };
+        walk_tree(fs, block, depth, work);
+        return true;
+    }
+
+    // somewhere in the middle, only pointer blocks get here
+    auto bs = node->block_size;
+    auto pointers = new uint32_t[bs / 4];
+    fs->read_all(block * bs, bs, (char*) pointers);
+    uint32_t childSpan = span / (bs / 4);
+    for (uint32_t i = 0; i < bs / 4; i++) {
+        if ((pointers[i] != 0) && trim_tree(node, pointers[i], depth - 1, first + i * childSpan, childSpan, keep)) {
+            uint32_t zero = 0;
+            fs->log_all(block * bs + i * 4, (char*) &zero, 4);
+        }
+    }
+    delete[] pointers;
+    return false;
+}
+
+void Node::free_blocks(uint32_t keep) {
+    // the map can't keep blocks that are about to be somebody else's
+    LockGuard g{map->lock};
+    map->discard(this);
+    map->lastPhysical = 0;
+    for (uint32_t i = 0; i < BlockMap::LEVELS; i++) {
+        map->refs[i].release();
+        map->pinned[i] = 0;
+    }
+
+    const uint32_t perBlock = block_size / 4;
+    uint32_t first = 0;
+    uint32_t span = 1;
+    for (uint32_t i = 0; i < 15; i++) {
+        if (i >= 12) span *= perBlock;
+        uint32_t depth = (i < 12) ? 0 : i - 11;
+        if (trim_tree(this, inode->blockAddresses[i], depth, first, span, keep)) {
+            inode->blockAddresses[i] = 0;
+        }
+        first += span;
+    }
+    if (keep == 0) inode->sectors = 0;
+    dirty = true;
+}
+
+void Node::truncate(uint32_t size) {
+    if (size > inode->sizeInBytes) return;
+    // short symbolic links keep the name in the i-node
+    bool blocks = !(is_symlink() && inode->sizeInBytes <= 60);
+    uint32_t keep = divisionRoundUp(size, block_size);
+    uint32_t end = size_in_blocks();
+
+    while (true) {
+        Handle h{fileSystem};
+        uint32_t to = (end > keep + FREE_CHUNK) ? end - FREE_CHUNK : keep;
+        if (blocks) free_blocks(to);
+        // shorter after every chunk, a crash leaves a whole file
+        inode->sizeInBytes = (to == keep) ? size : to * block_size;
+        dirty = true;
+        // the bitmaps join the transaction now, the next handle sees
+        // how big it got
+        fileSystem->write_metadata();
+        if (to == keep) return;
+        end = to;
+    }
+}
+
+void Node::prefetch(uint32_t offset, uint32_t n) {
+    auto sz = size_in_bytes();
+    if (offset >= sz) return;
+    if (is_symlink() && sz <= 60) return;
+    n = K::min(n, sz - offset);
+    if (n == 0) return;
+
+    // one request per run of blocks that are next to each other on disk
+    uint32_t blockNumber = offset / block_size;
+    uint32_t last = (offset + n - 1) / block_size;
+    while (blockNumber <= last) {
+        uint32_t start = block_address(blockNumber);
+        uint32_t k = 1;
+        while ((blockNumber + k <= last) && (block_address(blockNumber + k) == start + k)) k++;
+        if (start != 0) fileSystem->prefetch(start * block_size, k * block_size);
+        blockNumber += k;
+    }
+}
+
+void Node::sync() {
+    // data blocks, a run at a time
+    if (!(is_symlink() && inode->sizeInBytes <= 60)) {
+        uint32_t n = size_in_blocks();
+        uint32_t i = 0;
+        while (i < n) {
+            uint32_t start = block_address(i);
+            uint32_t k = 1;
+            while ((i + k < n) && (block_address(i + k) == start + k)) k++;
+            if (start != 0) fileSystem->sync(start * block_size, k * block_size);
+            i += k;
+        }
+        // and the pointer blocks that lead to them
+        auto work = [this](uint32_t block, bool pointers) {
+            if (pointers) fileSystem->sync(block * block_size, block_size);
+        };
+        for (uint32_t i = 12; i < 15; i++) {
+            walk_tree(fileSystem, inode->blockAddresses[i], i - 11, work);
+        }
+    }
+
+    // the i-node and the rest of the metadata go in a commit, which
+    // flushes the data too
+    if (fileSystem->journal != nullptr) {
+        if (!fileSystem->journal->commit(false)) fileSystem->dev->flush_cache();
+        return;
+    }
+
+    fileSystem->write_node(this);
+    fileSystem->write_metadata();
+    fileSystem->sync(fileSystem->getInodeTableOffset(number), fileSystem->get_inode_size());
+    fileSystem->dev->flush_cache();
+}
 
 char *Node::get_entry_names(char* buff_start, uint32_t max_size) {
     ASSERT(is_dir());
 
     uint32_t byte = 0;
-    entries([&byte, buff_start](uint32_t, char* entry_name) {
-        K::strcpy(buff_start + byte, entry_name);
-        byte += K::strlen(entry_name) + 1; // increment by name length, +1 for null
+    entries([&byte, buff_start, max_size](uint32_t, const char* entry_name, uint32_t n) {
+        // leave room for this name's null and the one at the end
+        if (byte + n + 2 > max_size) return true;
+        memcpy(buff_start + byte, entry_name, n);
+        buff_start[byte + n] = '\0';
+        byte += n + 1;
+        return false;
     });
 
     buff_start[byte] = '\0'; // to indicate the end of the list
@@ -14,22 +14,48 @@
 struct SuperBlock {
     uint32_t totalInodes;
     uint32_t totalBlocks;
-    uint8_t notNeeded[16];
+    uint8_t notNeeded[4];
+    uint32_t freeBlocks;
+    uint32_t freeInodes;
+    uint32_t firstDataBlock;        // block 1 for 1K blocks, 0 otherwise
     uint32_t blockSizeShift;
     uint8_t notNeeded2[4];
     uint32_t blocksPerGroup;
     uint8_t notNeeded3[4];
     uint32_t inodesPerGroup;
-    uint8_t notNeeded4[980];
+    uint8_t notNeeded4[48];
+    uint32_t featureCompat;
+    uint32_t featureIncompat;
+    uint32_t featureRoCompat;
+    uint8_t notNeeded5[120];
+    uint32_t journalInode;          // with FEATURE_HAS_JOURNAL
+    uint8_t notNeeded6[8];
+    uint32_t hashSeed[4];           // for directory indexes
+    uint8_t defHashVersion;
+    uint8_t notNeeded7[99];
+    uint32_t flags;
+    uint8_t notNeeded8[668];
 };
 
+// featureCompat
+#define FEATURE_HAS_JOURNAL 0x4
+#define FEATURE_DIR_INDEX 0x20
+
+// featureIncompat, the journal may have to be replayed
+#define FEATURE_RECOVER 0x4
+
+// SuperBlock::flags, how the directory hashes treat chars
+#define FLAGS_SIGNED_HASH 0x1
+#define FLAGS_UNSIGNED_HASH 0x2
+
 struct BlockGroupDescriptor {
     uint32_t blockUsageAddress;
     uint32_t inodeUsageAddress;
     uint32_t inodeTableAddress;
     uint16_t availableBlocks;
     uint16_t availableInodes;
-    uint8_t notNeeded2[16];
+    uint16_t usedDirs;
+    uint8_t notNeeded2[14];
 };
 
 struct Inode {
@@ -38,12 +64,23 @@ struct Inode {
     uint32_t sizeInBytes;
     uint8_t notNeeded2[18];
     uint16_t numHardLinks;
-    uint8_t notNeeded3[12];
+    uint32_t sectors;
+    uint32_t flags;
+    uint8_t notNeeded3[4];
     uint32_t blockAddresses[15];
     uint8_t notNeeded4[28];
 };
 
+// Inode::flags, the directory has a hash index (see htree.h)
+#define INODE_INDEX_FL 0x1000
+
 class Node;
+class Buffer;
+struct NodeCache;
+struct DentryCache;
+struct BlockMap;
+struct Allocator;
+struct Journal;
 
 // This class encapsulates the implementation of the Ext2 file system
 class Ext2 {
@@ -51,29 +88,63 @@ private:
     // The device on which the file system resides
     Atomic<uint32_t> ref_count{0};
 
-    // allocate first available structure
-    int findAvailableStructure(uint32_t startingNumber, char **usageBitmaps, uint32_t structuresPerGroup);
+    // Takes the first clear bit at or after "start" (wrapping around) in
+    // the i-node or block bitmaps, returns its index or -1 if all are set.
+    // Up to "maxRun" bits in a row get taken if they are clear, "run"
+    // says how many did
+    int findAvailableStructure(bool inodes, uint32_t start, uint32_t maxRun = 1, uint32_t* run = nullptr);
+
+    // The group a new i-node should go in (see ext2.cc)
+    uint32_t findGroupForInode(Node* parent, bool directory);
+
+    // One more (or one less) directory in the i-node's group
+    void countDirectory(uint32_t inodeNumber, int delta);
     
     // delete directory entry from dir
     void deleteDirectoryEntry(Shared<Node> dir, uint32_t numberToDelete);
 
-    void freeStructure(uint32_t number, char **usageBitmaps, uint32_t structuresPerGroup);
+    void freeStructure(bool inodes, uint32_t index);
+
+    // A bitmap of "group" changed, and with it the group descriptor and
+    // the superblock counts. Call with the allocator lock held
+    void dirtyAllocation(bool inodes, uint32_t group);
+
+    // hints and the lock for the bitmaps (see ext2.cc)
+    Allocator* allocator;
+
+    // Copies the dirty i-nodes and allocation metadata to the buffer
+    // cache, write_back without the journal
+    void write_dirty(bool discard);
+
+    friend struct Journal;
 
-    void createInode(uint16_t fileType, int inodeNumber);
+    // A fresh i-node of the given type, it's only in memory for now
+    Shared<Node> createInode(uint16_t fileType, int inodeNumber);
+
+    // the i-nodes we have in memory (see ext2.cc)
+    NodeCache* nodes;
 
 public:
     Shared<Node> root; // The root directory for this file system
-    Shared<Ide> ide;
+    Shared<BlockIO> dev; // an Ide, a RamDisk, ...
     SuperBlock *superBlock;
+    Journal* journal = nullptr;     // nullptr if the volume has none (see journal.h)
     uint32_t numBlockGroups;
     BlockGroupDescriptor *blockGroupTable;
     char **inodeUsageBitmaps;
     char **blockUsageBitmaps;
 
+    // (directory, name) -> i-number, names that aren't there too (see ext2.cc)
+    DentryCache *dentries;
+
 public:
     // Mount an existing file system residing on the given device
     // Panics if the file system is invalid
-    Ext2(Shared<Ide> ide);
+    Ext2(Shared<BlockIO> dev);
+
+    // true if the device has an ext2 super block for a volume we can
+    // address (it fits on the device and in 4GB)
+    static bool probe(BlockIO* dev);
 
     // Returns the block size of the file system. Doesn't have
     // to match that of the underlying device
@@ -89,18 +160,34 @@ public:
         return 128;
     }
 
-    // allocate first available block
-    int findAvailableBlock();
+    // allocate a block, the first free one at or after "goal" (0 for
+    // anywhere), -1 if there is none. With "maxRun" > 1, the free blocks
+    // right after it are taken too, "run" says how many we got in all
+    int findAvailableBlock(uint32_t goal = 0, uint32_t maxRun = 1, uint32_t* run = nullptr);
     
-    // allocate first available inode
-    int findAvailableInode();
+    // allocate an inode for a new entry in "parent"
+    int findAvailableInode(Node* parent, bool directory);
 
     void freeBlock(uint32_t blockNumber);
 
-    void freeInode(uint32_t inodeNumber);
+    void freeInode(uint32_t inodeNumber, bool directory);
 
+    // The node for i-node "number", the same one for everybody who
+    // asks while it's in the cache
     Shared<Node> get_node(uint32_t number);
 
+    // Writes the i-node back (to the buffer cache) if it changed
+    void write_node(Node* node);
+
+    // Writes the changed bitmaps, group descriptors and superblock counts
+    // back (to the buffer cache)
+    void write_metadata();
+
+    // Both of the above for everything that changed, the flusher calls it
+    // every so often. "discard" also gives back the preallocated blocks.
+    // With a journal this is a commit
+    void write_back(bool discard);
+
     uint32_t getInodeTableOffset(uint32_t inodeNumber) {
         uint32_t blockGroup = (inodeNumber - 1) / superBlock->inodesPerGroup;
         uint32_t inodeIndex = (inodeNumber - 1) % superBlock->inodesPerGroup;
@@ -111,17 +198,27 @@ public:
         return inodeOffset;
     }
 
-    void write_all(uint32_t diskOffset, char *bufferToWrite, uint32_t bytesToWrite) {
-        // write to blocks
-        int remainingBytes = bytesToWrite;
-        uint32_t curOffset = diskOffset;
-        while (remainingBytes > 0) {
-            uint32_t writeCount = ide->write(curOffset, bufferToWrite, remainingBytes);
-            bufferToWrite += writeCount;
-            curOffset += writeCount;
-            remainingBytes -= writeCount;
-        }
-    }
+    // All the metadata and data goes through the buffer cache
+    void read_all(uint32_t diskOffset, uint32_t bytesToRead, char *buffer);
+
+    void write_all(uint32_t diskOffset, char *bufferToWrite, uint32_t bytesToWrite);
+
+    // Same for metadata, with a journal the change is part of the running
+    // transaction and only goes home after it commits. Call it in a Handle
+    void log_all(uint32_t diskOffset, char *bufferToWrite, uint32_t bytesToWrite);
+
+    // Starts reading the given range of the disk in the background
+    void prefetch(uint32_t diskOffset, uint32_t n);
+
+    // Makes everything written so far durable
+    void sync();
+
+    // Syncs and leaves the volume clean (an empty journal), the last
+    // thing we do with it
+    void unmount();
+
+    // Same for the given range of the disk
+    void sync(uint32_t diskOffset, uint32_t n);
 
     bool createNode(Shared<Node> dir, const char* name, uint8_t typeIndicator);
 
@@ -136,33 +233,56 @@ public:
     friend class Shared<Ext2>;
 };
 
+// Keeps the journal's running transaction open while a change to the
+// file system is under way so a commit never gets half of it. Handles
+// nest, and do nothing on volumes without a journal (see journal.h)
+class Handle {
+    Journal* const journal;
+public:
+    explicit Handle(Ext2* fs);
+    ~Handle();
+    Handle(const Handle&) = delete;
+};
+
+// Keeps a file system block in the buffer cache so we can look at it
+// without copying it. "data" is good until the next pin() or until the
+// BlockRef goes away
+class BlockRef {
+    Buffer* buffer = nullptr;
+public:
+    const char* data = nullptr;
+
+    BlockRef() {}
+    BlockRef(const BlockRef&) = delete;
+    ~BlockRef() { release(); }
+
+    void pin(Ext2* fs, uint32_t diskBlock);
+    void release();
+};
+
 // A wrapper around an i-node
 class Node : public BlockIO { // we implement BlockIO because we
                               // represent data
-    Atomic<uint32_t> ref_count{0};
-
 public:
     const uint32_t number; // i-number of this node
     Inode *inode;
     uint32_t type;
     Ext2 *fileSystem;
 
-    Node(uint32_t block_size, uint32_t number, Ext2 *fileSystem) : BlockIO(block_size), number(number) {
-        uint32_t blockGroup = (number - 1) / fileSystem->superBlock->inodesPerGroup;
-        uint32_t inodeIndex = (number - 1) % fileSystem->superBlock->inodesPerGroup;
+    // the in-memory i-node changed, Ext2::write_node writes it back
+    volatile bool dirty = false;
 
-        char *inode = new char[128];
-        uint32_t byteInodeTableAddress = fileSystem->blockGroupTable[blockGroup].inodeTableAddress * block_size;
-        uint32_t inodeOffset = byteInodeTableAddress + inodeIndex * 128;
+    // owned by the i-node cache (under its lock)
+    Node* hashNext = nullptr;
+    Node* lruPrev = nullptr;
+    Node* lruNext = nullptr;
 
-        fileSystem->ide->read_all(inodeOffset, 128, inode);
+    // logical to disk block translation past the direct blocks (see ext2.cc)
+    BlockMap* map;
 
-        this->inode = (Inode *) inode;
-        this->type = this->inode->typesAndPermissions & 0xF000;
-        this->fileSystem = fileSystem;
-    }
+    Node(uint32_t block_size, uint32_t number, Ext2 *fileSystem);
 
-    virtual ~Node() {}
+    virtual ~Node();
 
     Shared<Node> get_node(uint32_t number);
 
@@ -174,24 +294,84 @@ public:
         return inode->sizeInBytes;
     }
 
+    // disk block that holds the given block of this node, 0 if there is
+    // none. With "allocate" the block (and the pointer blocks on the way
+    // to it) gets allocated if it's missing, 0 if the volume is full
+    uint32_t block_address(uint32_t blockNumber, bool allocate = false);
+
+    // Frees the data blocks past the first "keep" and the pointer blocks
+    // that only led to them (all of them by default). Call it in a Handle
+    void free_blocks(uint32_t keep = 0);
+
+    // Shrinks a file to "size" bytes, a bigger size does nothing. The
+    // blocks go FREE_CHUNK at a time from the end, each chunk in its own
+    // handle, so a big file doesn't have to fit in one transaction
+    constexpr static uint32_t FREE_CHUNK = 1024;
+    void truncate(uint32_t size);
+
+    // Gives back the blocks reserved for this node's next writes
+    void discard_prealloc();
+
     // read the given block (panics if the block number is not valid)
-    // remember that block size is defined by the file system not the device
+    // remember that block size is defined by the file system not the device.
+    // A hole (no disk block) reads as zeros
     void read_block(uint32_t blockNumber, char* buffer) override {
-        if (blockNumber < 12) { // direct case
-            uint32_t blockAddress = inode->blockAddresses[blockNumber];
-            fileSystem->ide->read_all(blockAddress * block_size, block_size, buffer);
-        } else { // singly indirect case
-            uint32_t blockAddress = inode->blockAddresses[12];
-            fileSystem->ide->read_all(blockAddress * block_size, block_size, buffer);
-            blockNumber -= 12;
-            blockAddress = ((uint32_t *) buffer)[blockNumber];
-            fileSystem->ide->read_all(blockAddress * block_size, block_size, buffer);
+        read_part(blockNumber, 0, block_size, buffer);
+    }
+
+    // straight out of the cached disk block
+    void read_part(uint32_t blockNumber, uint32_t offset, uint32_t n, char* buffer) override {
+        auto address = block_address(blockNumber);
+        if (address == 0) {
+            bzero(buffer, n);
+            return;
         }
+        fileSystem->read_all(address * block_size + offset, n, buffer);
     }
 
+    // Blocks that sit next to each other on disk are read together so
+    // large reads (ELF segments, big files) turn into a few long transfers
+    int64_t read_all(uint32_t offset, uint32_t n, char* buffer) override {
+        auto sz = size_in_bytes();
+        if (offset > sz) return -1;
+        n = K::min(n, sz - offset);
+
+        uint32_t remaining = n;
+        while (remaining > 0) {
+            uint32_t blockNumber = offset / block_size;
+            uint32_t blockAddress = block_address(blockNumber);
+            uint32_t diskOffset = blockAddress * block_size + offset % block_size;
+            uint32_t count = K::min(remaining, block_size - offset % block_size);
+            if (blockAddress == 0) {
+                // a hole
+                bzero(buffer, count);
+            } else {
+                while (count < remaining) {
+                    if (block_address(++blockNumber) != ++blockAddress) break;
+                    count += K::min(remaining - count, block_size);
+                }
+                fileSystem->read_all(diskOffset, count, buffer);
+            }
+            offset += count;
+            buffer += count;
+            remaining -= count;
+        }
+        return n;
+    }
+
+    // Asks for the blocks under [offset,offset+n) ahead of time, the
+    // reads that follow find them in the cache
+    void prefetch(uint32_t offset, uint32_t n);
+
     // when writing directory entries, we need to first zero out the remainder of a block if 
     // there isn't enough remaining space for the new entry
-    void write_all(uint32_t fileOffset, char *bufferToWrite, uint32_t bytesToWrite) {
+    //
+    // Each WRITE_CHUNK blocks get their own handle so a big write doesn't
+    // have to fit in one transaction
+    constexpr static uint32_t WRITE_CHUNK = 16;
+    //
+    // Returns how much got written, less than asked when the volume fills up
+    uint32_t write_all(uint32_t fileOffset, char *bufferToWrite, uint32_t bytesToWrite) {
         if (fileOffset > size_in_bytes()) {
             Debug::panic("PANIC: FileOffset requested to write is greater than file size\n");
         }
@@ -199,111 +379,75 @@ public:
         // write to file
         int remainingBytes = bytesToWrite;
         uint32_t curOffset = fileOffset;
-        while (remainingBytes > 0) {
-            uint32_t blockNumber = curOffset / block_size;
-            uint32_t blockOffset = curOffset % block_size;
-
-            if (blockNumber < 12) {
-                // invalid blockAddress. We need to allocate a new block for this node
-                if (inode->blockAddresses[blockNumber] == 0) {
-                    inode->blockAddresses[blockNumber] = fileSystem->findAvailableBlock();
+        bool full = false;
+        while ((remainingBytes > 0) && !full) {
+            Handle h{fileSystem};
+            for (uint32_t k = 0; (k < WRITE_CHUNK) && (remainingBytes > 0); k++) {
+                uint32_t blockNumber = curOffset / block_size;
+                uint32_t blockOffset = curOffset % block_size;
+
+                uint32_t blockAddress = block_address(blockNumber, true);
+                if (blockAddress == 0) {
+                    full = true;
+                    break;
                 }
-                uint32_t blockAddress = inode->blockAddresses[blockNumber];
                 uint32_t writeAddress = blockAddress * block_size + blockOffset;
 
-                uint32_t writeCount = fileSystem->ide->write(writeAddress, bufferToWrite, remainingBytes);
+                uint32_t writeCount = K::min(uint32_t(remainingBytes), block_size - blockOffset);
+                // directories are metadata
+                if (is_dir()) {
+                    fileSystem->log_all(writeAddress, bufferToWrite, writeCount);
+                } else {
+                    fileSystem->write_all(writeAddress, bufferToWrite, writeCount);
+                }
                 curOffset += writeCount;
                 bufferToWrite += writeCount;
                 remainingBytes -= writeCount;
-            } else {
-                Debug::panic("PANIC: Haven't handled writing indirection yet\n");
             }
-        }
 
-        // update file size
-        int addedBytes = (fileOffset + bytesToWrite) - inode->sizeInBytes;
-        inode->sizeInBytes += addedBytes;
-        
-        // update inode table with new size and other info
-        fileSystem->write_all(fileSystem->getInodeTableOffset(number), (char *) inode, fileSystem->get_inode_size());
-    }
-
-    void deleteFromDirectory(uint32_t inodeToDelete) {
-        char initBuffer[inode->sizeInBytes];
-        char *buffer = initBuffer;
-        read_all(0, inode->sizeInBytes, buffer);
-
-        uint32_t curByte = 0;
-
-        while (curByte < inode->sizeInBytes) {
-            uint32_t inodeNumber = *((uint32_t *) buffer);
-            uint32_t entrySize = *((uint16_t *) (buffer + 4));
-            // zero out this directory entry (make it a dummy entry)
-            if (inodeNumber == inodeToDelete) {
-                char zeroEntry[entrySize];
-                // zero out first 4 bytes
-                for (uint32_t i = 0; i < 4; i++) {
-                    zeroEntry[i] = 0;
-                }
-
-                // add in entry size
-                *((uint16_t *) (zeroEntry + 4)) = entrySize;
-
-                // zero out remaining bytes
-                for (uint32_t i = 6; i < entrySize; i++) {
-                    zeroEntry[i] = 0;
-                }
-                
-                write_all(curByte, zeroEntry, entrySize);
-                break;
-            } else {
-                curByte += entrySize;
-                buffer += entrySize;
+            // update file size, writes in the middle don't change it
+            if (curOffset > inode->sizeInBytes) {
+                inode->sizeInBytes = curOffset;
             }
+
+            // the i-node goes back when the cache evicts it or on sync
+            dirty = true;
         }
+        return curOffset - fileOffset;
     }
 
-    // only works for direct blocks currently
-    int deleteNode(Shared<Node> parentDirectory) {
+    // Removes the entry "name" -> "inodeToDelete" from this directory
+    void deleteFromDirectory(uint32_t inodeToDelete, const char* name, uint32_t length);
+
+    int deleteNode(Shared<Node> parentDirectory, const char* name, uint32_t length) {
         if (number == 2) {
             return -2;
         }
 
         if (is_dir()) {
-            char initBuffer[inode->sizeInBytes];
-            char *buffer = initBuffer;
-            read_all(0, inode->sizeInBytes, buffer);
-            
-            uint32_t curByte = 0;
-            while (curByte < size_in_bytes()) {
-                uint32_t inodeNumber = *((uint32_t *) buffer);
-                // don't delete dummy entries or . and .. entries
-                if (inodeNumber != 0 && inodeNumber != number && inodeNumber != parentDirectory->number) {
+            auto parent = parentDirectory->number;
+            entries([this, parent](uint32_t inodeNumber, const char* nm, uint32_t n) {
+                // don't delete . and .. entries
+                if (inodeNumber != number && inodeNumber != parent) {
                     Shared<Node> childNode = fileSystem->get_node(inodeNumber);
-                    childNode->deleteNode(Shared<Node>{this});
+                    childNode->deleteNode(Shared<Node>{this}, nm, n);
                 }
-                uint32_t entrySize = *((uint16_t *) (buffer + 4));
-        
-                curByte += entrySize;
-                buffer += entrySize;
-            }
+                return false;
+            });
         }
 
-        // delete all data blocks associated with inode
-        if (!(is_symlink() && inode->sizeInBytes < 60)) {
-            for (uint32_t i = 0; i < 15; i++) {
-                // invalid address. no more blocks to free
-                if (inode->blockAddresses[i] == 0) {
-                    break;
-                } else { // free up block
-                    fileSystem->freeBlock(inode->blockAddresses[i]);
-                }
-            }
-        }
+        // a file's data blocks go a chunk per transaction (see truncate),
+        // a directory's go with its name so it's never left empty
+        if (!is_dir()) truncate(0);
+
+        // one transaction per node, a big tree doesn't have to fit in
+        // the journal at once
+        Handle h{fileSystem};
+        if (is_dir()) free_blocks();
 
         // free my own inode self
-        parentDirectory->deleteFromDirectory(number);
-        fileSystem->freeInode(number);
+        parentDirectory->deleteFromDirectory(number, name, length);
+        fileSystem->freeInode(number, is_dir());
 
         return 1;
     }
@@ -328,25 +472,58 @@ public:
         return type == 0xA000;
     }
 
+    // Calls work(number,name,length) for every entry of this directory.
+    // The entries are parsed in place, straight out of the buffer cache:
+    // "name" is not 0 terminated and is only good during the call. The
+    // walk stops as soon as work returns true.
+    //
+    // Entries we wrote ourselves can straddle two blocks, those pieces
+    // get copied to the stack.
     template <typename Work>
     void entries(Work work) {
+        entries_at([&work](uint32_t, uint32_t number, const char* name, uint32_t length) {
+            return work(number, name, length);
+        });
+    }
+
+    // Same, work(offset,number,name,length) also gets where the entry is
+    template <typename Work>
+    void entries_at(Work work) {
         ASSERT(is_dir());
+        const uint32_t size = inode->sizeInBytes;
+        BlockRef block{};
+        uint32_t pinned = ~uint32_t(0);
         uint32_t offset = 0;
 
-        while (offset < inode->sizeInBytes) {
-            uint32_t inode;
-            read(offset,inode);
-            uint16_t total_size;
-            read(offset+4,total_size);
+        while (offset + 8 <= size) {
+            uint32_t blockNumber = offset / block_size;
+            uint32_t inBlock = offset % block_size;
+            if (blockNumber != pinned) {
+                auto address = block_address(blockNumber);
+                if (address == 0) break;      // directories have no holes
+                block.pin(fileSystem, address);
+                pinned = blockNumber;
+            }
+
+            char header[8];
+            const char* entry = block.data + inBlock;
+            if (inBlock + 8 > block_size) {
+                read_all(offset, 8, header);
+                entry = header;
+            }
+            uint32_t inode = *((const uint32_t*) entry);
+            uint16_t total_size = *((const uint16_t*) (entry + 4));
+            uint8_t name_length = entry[6];
+            if (total_size < 8) break;    // corrupt, don't spin
+
             if (inode != 0) {
-                uint8_t name_length;
-                read(offset+6,name_length);
-                auto name = new char[name_length+1];
-                name[name_length] = 0;
-                auto cnt = read_all(offset+8,name_length,name);
-                ASSERT(cnt == name_length);
-                work(inode,name);
-                delete[] name;
+                char copy[256];
+                const char* name = entry + 8;
+                if (inBlock + 8 + name_length > block_size) {
+                    read_all(offset + 8, name_length, copy);
+                    name = copy;
+                }
+                if (work(offset, inode, name, uint32_t(name_length))) return;
             }
             offset += total_size;
         }
@@ -381,29 +558,19 @@ public:
     // Panics if not a directory
     uint32_t entry_count() {
         uint32_t entryCount = 0;
-        char *buffer = new char[inode->sizeInBytes];
-        char *initBuffer = buffer;
-        read_all(0, inode->sizeInBytes, buffer);
-
-        uint32_t curByte = 0;
-        while (curByte < inode->sizeInBytes) {
-            uint32_t inodeNumber = *((uint32_t *) buffer);
-            uint32_t entrySize = *((uint16_t *) (buffer + 4));
-            curByte += entrySize;
-            buffer += entrySize;
-            if (inodeNumber > 0) {
-                entryCount++;
-            }
-        }
+        entries([&entryCount](uint32_t, const char*, uint32_t) {
+            entryCount++;
+            return false;
+        });
         return entryCount;
-
-        delete[] initBuffer;
     }
 
+    // Writes back this node's dirty data and i-node (fsync)
+    void sync();
+
     char *get_entry_names(char* buff_start, uint32_t max_size);
     uint32_t find(const char* name);
 
-    friend class Shared<Node>;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,674 @@
+#include "htree.h"
+#include "machine.h"
+#include "debug.h"
+#include "libk.h"
+
+namespace HTree {
+
+    // RootInfo::hashVersion, UNSIGNED is added when the volume's hashes
+    // treat chars as unsigned
+    constexpr uint8_t LEGACY = 0;
+    constexpr uint8_t HALF_MD4 = 1;
+    constexpr uint8_t TEA = 2;
+    constexpr uint8_t UNSIGNED = 3;
+
+    // the root and at most one level of index nodes under it
+    constexpr uint32_t MAX_LEVELS = 2;
+
+    constexpr uint32_t ROOT_INFO = 24;      // after "." and ".."
+    constexpr uint32_t ROOT_ENTRIES = 32;
+    constexpr uint32_t NODE_ENTRIES = 8;    // after the empty entry
+    constexpr uint32_t BLOCK_MASK = 0x0FFFFFFF;
+
+    struct RootInfo {
+        uint32_t reserved;
+        uint8_t hashVersion;
+        uint8_t infoLength;
+        uint8_t indirectLevels;
+        uint8_t flags;
+    };
+
+    struct Entry {
+        uint32_t hash;      // the low bit says the previous block has more of this hash
+        uint32_t block;     // logical block of the directory
+    };
+
+    // takes the place of the hash of the first entry
+    struct CountLimit {
+        uint16_t limit;
+        uint16_t count;
+    };
+
+    ////////////
+    // Hashes //
+    ////////////
+
+    static inline uint32_t rol(uint32_t x, uint32_t s) {
+        return (x << s) | (x >> (32 - s));
+    }
+
+    static inline int char_value(char c, bool unsignedChars) {
+        return unsignedChars ? int((unsigned char) c) : int((signed char) c);
+    }
+
+    static uint32_t legacy(const char* name, uint32_t length, bool unsignedChars) {
+        uint32_t hash0 = 0x12a3fe2d;
+        uint32_t hash1 = 0x37abe8f9;
+        for (uint32_t i = 0; i < length; i++) {
+            uint32_t hash = hash1 + (hash0 ^ uint32_t(char_value(name[i], unsignedChars) * 7152373));
+            if (hash & 0x80000000) hash -= 0x7fffffff;
+            hash1 = hash0;
+            hash0 = hash;
+        }
+        return hash0 << 1;
+    }
+
+    // Packs up to "num" words of the name, padded with its length
+    static void to_words(const char* name, int length, uint32_t* out, int num, bool unsignedChars) {
+        uint32_t pad = uint32_t(length) | (uint32_t(length) << 8);
+        pad |= pad << 16;
+
+        uint32_t val = pad;
+        if (length > num * 4) length = num * 4;
+        for (int i = 0; i < length; i++) {
+            val = uint32_t(char_value(name[i], unsignedChars)) + (val << 8);
+            if ((i % 4) == 3) {
+                *out++ = val;
+                val = pad;
+                num--;
+            }
+        }
+        if (--num >= 0) *out++ = val;
+        while (--num >= 0) *out++ = pad;
+    }
+
+    static void half_md4(uint32_t buf[4], const uint32_t in[8]) {
+        constexpr uint32_t K2 = 013240474631u;
+        constexpr uint32_t K3 = 015666365641u;
+        auto F = [](uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+        auto G = [](uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+        auto H = [](uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+
+        uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+        a = rol(a + F(b,c,d) + in[0], 3);
+        d = rol(d + F(a,b,c) + in[1], 7);
+        c = rol(c + F(d,a,b) + in[2], 11);
+        b = rol(b + F(c,d,a) + in[3], 19);
+        a = rol(a + F(b,c,d) + in[4], 3);
+        d = rol(d + F(a,b,c) + in[5], 7);
+        c = rol(c + F(d,a,b) + in[6], 11);
+        b = rol(b + F(c,d,a) + in[7], 19);
+
+        a = rol(a + G(b,c,d) + in[1] + K2, 3);
+        d = rol(d + G(a,b,c) + in[3] + K2, 5);
+        c = rol(c + G(d,a,b) + in[5] + K2, 9);
+        b = rol(b + G(c,d,a) + in[7] + K2, 13);
+        a = rol(a + G(b,c,d) + in[0] + K2, 3);
+        d = rol(d + G(a,b,c) + in[2] + K2, 5);
+        c = rol(c + G(d,a,b) + in[4] + K2, 9);
+        b = rol(b + G(c,d,a) + in[6] + K2, 13);
+
+        a = rol(a + H(b,c,d) + in[3] + K3, 3);
+        d = rol(d + H(a,b,c) + in[7] + K3, 9);
+        c = rol(c + H(d,a,b) + in[2] + K3, 11);
+        b = rol(b + H(c,d,a) + in[6] + K3, 15);
+        a = rol(a + H(b,c,d) + in[1] + K3, 3);
+        d = rol(d + H(a,b,c) + in[5] + K3, 9);
+        c = rol(c + H(d,a,b) + in[0] + K3, 11);
+        b = rol(b + H(c,d,a) + in[4] + K3, 15);
+
+        buf[0] += a;
+        buf[1] += b;
+        buf[2] += c;
+        buf[3] += d;
+    }
+
+    static void tea(uint32_t buf[4], const uint32_t in[4]) {
+        uint32_t sum = 0;
+        uint32_t b0 = buf[0], b1 = buf[1];
+        for (int n = 0; n < 16; n++) {
+            sum += 0x9E3779B9;
+            b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+            b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+        }
+        buf[0] += b0;
+        buf[1] += b1;
+    }
+
+    uint32_t hash(Ext2* fs, uint8_t version, const char* name, uint32_t length) {
+        uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+        auto seed = fs->superBlock->hashSeed;
+        if ((seed[0] | seed[1] | seed[2] | seed[3]) != 0) {
+            for (uint32_t i = 0; i < 4; i++) buf[i] = seed[i];
+        }
+
+        bool unsignedChars = version >= UNSIGNED;
+        uint32_t in[8];
+        int left = length;
+        uint32_t out = 0;
+
+        switch (version % UNSIGNED) {
+        case LEGACY:
+            out = legacy(name, length, unsignedChars);
+            break;
+        case HALF_MD4:
+            for (auto p = name; left > 0; left -= 32, p += 32) {
+                to_words(p, left, in, 8, unsignedChars);
+                half_md4(buf, in);
+            }
+            out = buf[1];
+            break;
+        case TEA:
+            for (auto p = name; left > 0; left -= 16, p += 16) {
+                to_words(p, left, in, 4, unsignedChars);
+                tea(buf, in);
+            }
+            out = buf[0];
+            break;
+        }
+
+        // the low bit is for continuations, the top value is reserved
+        out &= ~1u;
+        if (out == (0x7fffffffu << 1)) out = (0x7fffffffu - 1) << 1;
+        return out;
+    }
+
+    //////////////////////
+    // Directory blocks //
+    //////////////////////
+
+    static uint32_t needed(uint32_t length) {
+        return (8 + length + 3) & ~3u;
+    }
+
+    static uint32_t blocks(Node* dir) {
+        return dir->size_in_bytes() / dir->block_size;
+    }
+
+    static bool pin(Node* dir, BlockRef& ref, uint32_t n) {
+        if (n >= blocks(dir)) return false;
+        auto address = dir->block_address(n);
+        if (address == 0) return false;
+        ref.pin(dir->fileSystem, address);
+        return true;
+    }
+
+    // Calls work(offset) for each entry of a directory block until it
+    // returns true. false if it never did (or the block doesn't parse)
+    template <typename Work>
+    static bool walk(const char* block, uint32_t blockSize, Work work) {
+        uint32_t offset = 0;
+        while (offset + 8 <= blockSize) {
+            uint32_t recLen = *(const uint16_t*) (block + offset + 4);
+            if ((recLen < 8) || ((recLen & 3) != 0) || (offset + recLen > blockSize)) return false;
+            if (work(offset)) return true;
+            offset += recLen;
+        }
+        return false;
+    }
+
+    // The entries of the block cover it exactly
+    static bool parses(const char* block, uint32_t blockSize) {
+        uint32_t end = 0;
+        walk(block, blockSize, [&](uint32_t offset) {
+            end = offset + *(const uint16_t*) (block + offset + 4);
+            return false;
+        });
+        return end == blockSize;
+    }
+
+    // Where "name" is in the block, -1 if it isn't
+    static int32_t lookup(const char* block, uint32_t blockSize, const char* name, uint32_t length) {
+        int32_t found = -1;
+        walk(block, blockSize, [&](uint32_t offset) {
+            auto e = block + offset;
+            if ((*(const uint32_t*) e == 0) || (uint8_t(e[6]) != length)) return false;
+            for (uint32_t i = 0; i < length; i++) {
+                if (e[8 + i] != name[i]) return false;
+            }
+            found = offset;
+            return true;
+        });
+        return found;
+    }
+
+    // the entry at "e" has room for "size" more bytes at its end
+    static bool room(const char* e, uint32_t size) {
+        uint32_t recLen = *(const uint16_t*) (e + 4);
+        uint32_t used = (*(const uint32_t*) e == 0) ? 0 : needed(uint8_t(e[6]));
+        return (used <= recLen) && (recLen - used >= size);
+    }
+
+    bool has_room(const char* block, uint32_t blockSize, uint32_t length) {
+        auto size = needed(length);
+        return walk(block, blockSize, [&](uint32_t offset) {
+            return room(block + offset, size);
+        });
+    }
+
+    bool put_entry(char* block, uint32_t blockSize, const char* name, uint32_t length, uint32_t number, uint8_t type) {
+        auto size = needed(length);
+        return walk(block, blockSize, [&](uint32_t offset) {
+            auto e = block + offset;
+            if (!room(e, size)) return false;
+            uint32_t recLen = *(uint16_t*) (e + 4);
+            uint32_t used = (*(uint32_t*) e == 0) ? 0 : needed(uint8_t(e[6]));
+            if (used != 0) {
+                // the new entry takes the slack at the end of this one
+                *(uint16_t*) (e + 4) = used;
+                e += used;
+                recLen -= used;
+            }
+            *(uint32_t*) e = number;
+            *(uint16_t*) (e + 4) = recLen;
+            e[6] = length;
+            e[7] = type;
+            memcpy(e + 8, name, length);
+            return true;
+        });
+    }
+
+    // A private copy of a directory block, goes back with write()
+    struct Copy {
+        Node* dir;
+        const uint32_t number;
+        char* const data;
+
+        Copy(Node* dir, uint32_t number) : dir(dir), number(number), data(new char[dir->block_size]) {
+            dir->read_all(number * dir->block_size, dir->block_size, data);
+        }
+        Copy(const Copy&) = delete;
+        ~Copy() {
+            delete[] data;
+        }
+
+        void write() {
+            dir->write_all(number * dir->block_size, data, dir->block_size);
+        }
+    };
+
+    // Adds an empty block at the end of the directory, returns its number
+    static uint32_t append(Node* dir) {
+        auto bs = dir->block_size;
+        auto n = blocks(dir);
+        auto data = new char[bs];
+        bzero(data, bs);
+        *(uint16_t*) (data + 4) = bs;
+        dir->write_all(n * bs, data, bs);
+        delete[] data;
+        return n;
+    }
+
+    struct Item {
+        uint32_t hash;
+        uint32_t offset;
+    };
+
+    // Lays the entries out back to back, the last one gets the rest of the block
+    static void pack(char* to, uint32_t blockSize, const char* from, const Item* items, uint32_t first, uint32_t end) {
+        bzero(to, blockSize);
+        *(uint16_t*) (to + 4) = blockSize;
+        uint32_t offset = 0;
+        uint32_t last = 0;
+        for (uint32_t i = first; i < end; i++) {
+            auto e = from + items[i].offset;
+            auto size = needed(uint8_t(e[6]));
+            memcpy(to + offset, e, size);
+            *(uint16_t*) (to + offset + 4) = size;
+            last = offset;
+            offset += size;
+        }
+        if (first != end) *(uint16_t*) (to + last + 4) = blockSize - last;
+    }
+
+    ///////////////
+    // The index //
+    ///////////////
+
+    // One index block on the way down
+    struct Frame {
+        uint32_t block;     // logical block
+        uint32_t entries;   // where the entries start
+        uint32_t count;
+        uint32_t limit;
+        uint32_t at;        // the entry we followed
+        BlockRef ref{};
+
+        const Entry* table() {
+            return (const Entry*) (ref.data + entries);
+        }
+    };
+
+    struct Path {
+        uint32_t hash;
+        uint8_t version;
+        uint32_t levels;    // index nodes under the root
+        Frame frames[MAX_LEVELS];
+
+        Frame& bottom() {
+            return frames[levels];
+        }
+
+        uint32_t leaf() {
+            auto& f = bottom();
+            return f.table()[f.at].block & BLOCK_MASK;
+        }
+    };
+
+    static bool load(Node* dir, Frame& f, uint32_t block, uint32_t entries, uint32_t limit) {
+        f.block = block;
+        f.entries = entries;
+        if (!pin(dir, f.ref, block)) return false;
+        auto cl = (const CountLimit*) (f.ref.data + entries);
+        f.limit = cl->limit;
+        f.count = cl->count;
+        f.at = 0;
+        return (f.limit == limit) && (f.count != 0) && (f.count <= f.limit);
+    }
+
+    // an index node is an empty entry that covers the whole block
+    static bool load_node(Node* dir, Frame& f, uint32_t block) {
+        auto bs = dir->block_size;
+        if (!load(dir, f, block, NODE_ENTRIES, (bs - NODE_ENTRIES) / sizeof(Entry))) return false;
+        return (*(const uint32_t*) f.ref.data == 0) && (*(const uint16_t*) (f.ref.data + 4) == bs);
+    }
+
+    // The last entry whose hash is <= "hash", the first one covers
+    // everything below the second
+    static void search(Frame& f, uint32_t hash) {
+        auto t = f.table();
+        uint32_t lo = 1;
+        uint32_t hi = f.count;
+        while (lo < hi) {
+            auto mid = (lo + hi) / 2;
+            if (t[mid].hash <= hash) lo = mid + 1; else hi = mid;
+        }
+        f.at = lo - 1;
+    }
+
+    // Walks the index down to the leaf that should hold "name"
+    static bool probe(Node* dir, Path& path, const char* name, uint32_t length) {
+        auto bs = dir->block_size;
+        auto fs = dir->fileSystem;
+        if ((dir->size_in_bytes() % bs) != 0) return false;
+
+        auto& root = path.frames[0];
+        if (!load(dir, root, 0, ROOT_ENTRIES, (bs - ROOT_ENTRIES) / sizeof(Entry))) return false;
+        auto info = (const RootInfo*) (root.ref.data + ROOT_INFO);
+        if ((info->reserved != 0) || (info->hashVersion > TEA) || (info->infoLength != 8)) return false;
+        if (info->indirectLevels >= MAX_LEVELS) return false;
+
+        path.levels = info->indirectLevels;
+        path.version = info->hashVersion;
+        if (fs->superBlock->flags & FLAGS_UNSIGNED_HASH) path.version += UNSIGNED;
+        path.hash = hash(fs, path.version, name, length);
+
+        search(root, path.hash);
+        for (uint32_t i = 1; i <= path.levels; i++) {
+            auto& up = path.frames[i - 1];
+            auto& f = path.frames[i];
+            if (!load_node(dir, f, up.table()[up.at].block & BLOCK_MASK)) return false;
+            search(f, path.hash);
+        }
+        return true;
+    }
+
+    // Names with the same hash can spill into the next leaf (its index
+    // entry has the low bit set), moves "path" there if that's the case
+    static bool next_leaf(Node* dir, Path& path) {
+        uint32_t i = path.levels;
+        while (path.frames[i].at + 1 == path.frames[i].count) {
+            if (i == 0) return false;
+            i--;
+        }
+        auto& f = path.frames[i];
+        f.at += 1;
+        if ((f.table()[f.at].hash & ~1u) != path.hash) return false;
+
+        for (uint32_t j = i + 1; j <= path.levels; j++) {
+            auto& up = path.frames[j - 1];
+            if (!load_node(dir, path.frames[j], up.table()[up.at].block & BLOCK_MASK)) return false;
+        }
+        return true;
+    }
+
+    // Inserts {hash,block} right after the entry "f" followed
+    static void insert(Node* dir, Frame& f, uint32_t hash, uint32_t block) {
+        Copy c{dir, f.block};
+        auto cl = (CountLimit*) (c.data + f.entries);
+        auto t = (Entry*) (c.data + f.entries);
+        ASSERT(cl->count < cl->limit);
+        for (uint32_t i = cl->count; i > f.at + 1; i--) {
+            t[i] = t[i - 1];
+        }
+        t[f.at + 1].hash = hash;
+        t[f.at + 1].block = block;
+        cl->count += 1;
+        c.write();
+    }
+
+    // Moves the upper half (by hash) of a full leaf to a new one
+    static bool split_leaf(Node* dir, Path& path) {
+        auto bs = dir->block_size;
+        auto fs = dir->fileSystem;
+        Copy leaf{dir, path.leaf()};
+        if (!parses(leaf.data, bs)) return false;
+
+        auto items = new Item[bs / 8];
+        uint32_t n = 0;
+        walk(leaf.data, bs, [&](uint32_t offset) {
+            auto e = leaf.data + offset;
+            if (*(uint32_t*) e != 0) {
+                items[n].hash = hash(fs, path.version, e + 8, uint8_t(e[6]));
+                items[n].offset = offset;
+                n++;
+            }
+            return false;
+        });
+        if (n < 2) {
+            delete[] items;
+            return false;
+        }
+
+        for (uint32_t i = 1; i < n; i++) {
+            auto it = items[i];
+            uint32_t j = i;
+            while ((j > 0) && (items[j - 1].hash > it.hash)) {
+                items[j] = items[j - 1];
+                j--;
+            }
+            items[j] = it;
+        }
+
+        auto half = n / 2;
+        auto split = items[half].hash;
+        // the lower half has some of this hash too, lookups have to look on
+        if (items[half - 1].hash == split) split |= 1;
+
+        auto to = append(dir);
+        Copy upper{dir, to};
+        pack(upper.data, bs, leaf.data, items, half, n);
+        auto lower = new char[bs];
+        pack(lower, bs, leaf.data, items, 0, half);
+        memcpy(leaf.data, lower, bs);
+        delete[] lower;
+        delete[] items;
+
+        upper.write();
+        leaf.write();
+        insert(dir, path.bottom(), split, to);
+        return true;
+    }
+
+    // The bottom index block is full, push the root's entries down a
+    // level or split the index node in two
+    static bool grow_index(Node* dir, Path& path) {
+        auto bs = dir->block_size;
+        uint32_t nodeLimit = (bs - NODE_ENTRIES) / sizeof(Entry);
+
+        if (path.levels == 0) {
+            Copy root{dir, 0};
+            auto rootTable = (Entry*) (root.data + ROOT_ENTRIES);
+            auto rootCl = (CountLimit*) rootTable;
+
+            auto to = append(dir);
+            Copy node{dir, to};
+            auto table = (Entry*) (node.data + NODE_ENTRIES);
+            for (uint32_t i = 0; i < rootCl->count; i++) {
+                table[i] = rootTable[i];
+            }
+            auto cl = (CountLimit*) table;
+            cl->limit = nodeLimit;
+            cl->count = rootCl->count;
+            node.write();
+
+            rootCl->count = 1;
+            rootTable[0].block = to;
+            ((RootInfo*) (root.data + ROOT_INFO))->indirectLevels = 1;
+            root.write();
+            return true;
+        }
+
+        // as big as it gets
+        if (path.frames[0].count == path.frames[0].limit) return false;
+
+        Copy node{dir, path.frames[1].block};
+        auto table = (Entry*) (node.data + NODE_ENTRIES);
+        auto cl = (CountLimit*) table;
+        uint32_t count = cl->count;
+        uint32_t half = count / 2;
+
+        auto to = append(dir);
+        Copy upper{dir, to};
+        auto upperTable = (Entry*) (upper.data + NODE_ENTRIES);
+        for (uint32_t i = half; i < count; i++) {
+            upperTable[i - half] = table[i];
+        }
+        auto split = table[half].hash;
+        auto upperCl = (CountLimit*) upperTable;
+        upperCl->limit = nodeLimit;
+        upperCl->count = count - half;
+        cl->count = half;
+
+        upper.write();
+        node.write();
+        insert(dir, path.frames[0], split, to);
+        return true;
+    }
+
+    bool find(Node* dir, const char* name, uint32_t length, uint32_t& out) {
+        Path path;
+        if (!probe(dir, path, name, length)) return false;
+
+        BlockRef leaf{};
+        out = 0;
+        do {
+            if (!pin(dir, leaf, path.leaf())) return false;
+            auto offset = lookup(leaf.data, dir->block_size, name, length);
+            if (offset >= 0) {
+                out = *(const uint32_t*) (leaf.data + offset);
+                return true;
+            }
+        } while (next_leaf(dir, path));
+        return true;
+    }
+
+    bool add(Node* dir, const char* name, uint32_t length, uint32_t number, uint8_t type) {
+        // each round adds the entry or makes room for it
+        for (uint32_t round = 0; round < 8; round++) {
+            Path path;
+            if (!probe(dir, path, name, length)) return false;
+            {
+                Copy leaf{dir, path.leaf()};
+                if (put_entry(leaf.data, dir->block_size, name, length, number, type)) {
+                    leaf.write();
+                    return true;
+                }
+            }
+            auto& bottom = path.bottom();
+            if (bottom.count < bottom.limit) {
+                if (!split_leaf(dir, path)) return false;
+            } else if (!grow_index(dir, path)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool remove(Node* dir, const char* name, uint32_t length, uint32_t number) {
+        Path path;
+        if (!probe(dir, path, name, length)) return false;
+
+        BlockRef leaf{};
+        do {
+            auto block = path.leaf();
+            if (!pin(dir, leaf, block)) return false;
+            auto offset = lookup(leaf.data, dir->block_size, name, length);
+            if ((offset >= 0) && (*(const uint32_t*) (leaf.data + offset) == number)) {
+                // an empty entry, put_entry reuses the space
+                uint32_t zero = 0;
+                dir->write_all(block * dir->block_size + offset, (char*) &zero, 4);
+                return true;
+            }
+        } while (next_leaf(dir, path));
+        return false;
+    }
+
+    bool make_indexed(Node* dir) {
+        auto bs = dir->block_size;
+        auto fs = dir->fileSystem;
+        if (dir->size_in_bytes() != bs) return false;
+
+        Copy root{dir, 0};
+        if (!parses(root.data, bs)) return false;
+
+        // "." and ".." have to come first, the way everybody makes them
+        auto dot = root.data;
+        auto dotdot = root.data + 12;
+        if ((*(uint16_t*) (dot + 4) != 12) || (dot[6] != 1) || (dot[8] != '.')) return false;
+        if ((dotdot[6] != 2) || (dotdot[8] != '.') || (dotdot[9] != '.')) return false;
+
+        // everything else moves to the first leaf
+        auto items = new Item[bs / 8];
+        uint32_t n = 0;
+        bool ok = true;
+        walk(root.data, bs, [&](uint32_t offset) {
+            if ((offset >= 24) && (*(uint32_t*) (root.data + offset) != 0)) {
+                items[n].hash = 0;
+                items[n].offset = offset;
+                n++;
+            } else if ((offset != 0) && (offset != 12) && (offset < 24)) {
+                ok = false;
+                return true;
+            }
+            return false;
+        });
+        if (!ok) {
+            delete[] items;
+            return false;
+        }
+
+        auto to = append(dir);
+        Copy leaf{dir, to};
+        pack(leaf.data, bs, root.data, items, 0, n);
+        delete[] items;
+        leaf.write();
+
+        bzero(root.data + ROOT_INFO, bs - ROOT_INFO);
+        *(uint16_t*) (dotdot + 4) = bs - 12;
+        auto info = (RootInfo*) (root.data + ROOT_INFO);
+        info->hashVersion = (fs->superBlock->defHashVersion <= TEA) ? fs->superBlock->defHashVersion : HALF_MD4;
+        info->infoLength = 8;
+        auto table = (Entry*) (root.data + ROOT_ENTRIES);
+        auto cl = (CountLimit*) table;
+        cl->limit = (bs - ROOT_ENTRIES) / sizeof(Entry);
+        cl->count = 1;
+        table[0].block = to;
+        root.write();
+
+        dir->inode->flags |= INODE_INDEX_FL;
+        dir->dirty = true;
+        return true;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef _HTREE_H_
+#define _HTREE_H_
+
+#include "stdint.h"
+#include "ext2.h"
+
+//
+// Hashed directory indexes (ext2 dir_index, a.k.a. htree)
+//
+// An indexed directory keeps its entries in leaf blocks, each holding a
+// range of name hashes, and a one or two level index on top:
+//
+//     block 0:  "."  ".." (covering the rest)  root info  limit/count  {hash,block}...
+//     node:     empty entry (covering the block)  limit/count  {hash,block}...
+//     leaf:     ordinary directory entries
+//
+// The index blocks look like empty space to anybody who walks the
+// directory linearly (Node::entries, old kernels), so only lookups and
+// changes have to know about it. A name costs one block per level plus
+// its leaf instead of a scan of the whole directory.
+//
+// mkfs.ext2 makes linear directories, createDirectoryEntry turns one into
+// an indexed directory when it outgrows its first block (and the volume
+// has the dir_index feature). Anything we can't make sense of makes these
+// return false, the caller then falls back to the linear code.
+//
+namespace HTree {
+
+    // The directory says it has an index
+    inline bool indexed(Node* dir) {
+        return (dir->inode->flags & INODE_INDEX_FL) != 0;
+    }
+
+    // The hash of "name" the way the index of "fs" wants it
+    uint32_t hash(Ext2* fs, uint8_t version, const char* name, uint32_t length);
+
+    // Looks "name" up, "out" is its i-number (0 if it's not there)
+    bool find(Node* dir, const char* name, uint32_t length, uint32_t& out);
+
+    // Adds an entry, splitting leaves and growing the index as needed
+    bool add(Node* dir, const char* name, uint32_t length, uint32_t number, uint8_t type);
+
+    // Removes the entry "name" -> "number"
+    bool remove(Node* dir, const char* name, uint32_t length, uint32_t number);
+
+    // Moves the entries of a full one block directory to a leaf and puts
+    // an index in front of them
+    bool make_indexed(Node* dir);
+
+    // Puts an entry in the first gap big enough for it in "block", false
+    // if there is none. Works for any directory block
+    //
+    // has_room says whether put_entry would find one, without a copy of
+    // the block to change
+    bool has_room(const char* block, uint32_t blockSize, uint32_t length);
+    bool put_entry(char* block, uint32_t blockSize, const char* name, uint32_t length, uint32_t number, uint8_t type);
+}
+
+#endif
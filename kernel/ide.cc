@@ -5,6 +5,17 @@
 #include "threads.h"
 #include "atomic.h"
 #include "smp.h"
+#include "bcache.h"
+#include "libk.h"
+#include "physmem.h"
+#include "pci.h"
+#include "ioapic.h"
+#include "idt.h"
+#include "semaphore.h"
+#include "blocking_lock.h"
+#include "future.h"
+#include "pit.h"
+#include "iostat.h"
 
 // The drive number encodes the controller in bit 1 and the channel in bit 0
 
@@ -40,8 +51,23 @@ static inline long getStatus(uint32_t drive) {
 #define DRDY    0x40
 #define BSY 0x80
     
-/* Simple polling PIO interface
-   Need to use interrupts and DMA
+// What IDENTIFY DEVICE told us about each drive
+struct Identity {
+    bool present = false;       // an ATA disk that does LBA
+    bool lba48 = false;
+    bool dma = false;           // multiword or ultra DMA
+    uint32_t multiple = 0;      // sectors per interrupt for READ/WRITE MULTIPLE, 0 -> off
+    uint64_t sectors = 0;
+};
+
+static Identity identities[4];
+
+// made the first time we find the drive, drives don't go away
+static IoStats* driveStats[4];
+
+/* Interrupt driven: the issuing thread sleeps until the drive
+   interrupts. Bus master DMA when the controller can do it and PIO
+   otherwise
  */
 
 static void waitForDrive(uint32_t drive) {
@@ -57,98 +83,712 @@ static void waitForDrive(uint32_t drive) {
     }
 }
 
-static uint32_t nRead = 0;
-static uint32_t nWrite = 0;
+Ide::~Ide() {
+    BCache::invalidate(this);
+}
 
-void Ide::read_block(uint32_t sector, char* buffer) {
-    LockGuard g{lock};
-    uint32_t* ptr = (uint32_t*) buffer;
+static void init();
+static void identify(uint32_t drive);
 
-    nRead += 1;
-    int base = port(drive);
-    int ch = channel(drive);
+Ide::Ide(uint32_t drive) : BlockIO(sector_size), drive(drive) {
+    init();
+    identify(drive);
+}
 
-    waitForDrive(drive);
+bool Ide::exists() {
+    return identities[drive].present;
+}
 
-    outb(base + 2, 1);          // sector count
-    outb(base + 3, sector >> 0);    // bits 7 .. 0
-    outb(base + 4, sector >> 8);    // bits 15 .. 8
-    outb(base + 5, sector >> 16);   // bits 23 .. 16
-    outb(base + 6, 0xE0 | (ch << 4) | ((sector >> 24) & 0xf));
-    outb(base + 7, 0x20);       // read with retry
+IoStats* Ide::stats() {
+    return driveStats[drive];
+}
 
-    waitForDrive(drive);
+uint64_t Ide::size_in_sectors() {
+    return identities[drive].sectors;
+}
 
-    while ((getStatus(drive) & DRQ) == 0) {
-        pause();
+uint32_t Ide::size_in_bytes() {
+    // byte offsets are 32 bits, anything past 4GB is out of reach
+    auto bytes = size_in_sectors() * sector_size;
+    return (bytes > 0xFFFFFE00) ? 0xFFFFFE00 : uint32_t(bytes);
+}
+
+////////////////
+// interrupts //
+////////////////
+
+// A queued transfer, adjacent ones are merged into a single command
+struct Request {
+    uint32_t drive;
+    bool write;
+    bool flush;                 // FLUSH CACHE, no data
+    uint32_t sector;
+    uint32_t count;
+    char* buffer;
+    uint32_t deadline;          // in jiffies
+    uint64_t submitted;         // TSC
+    uint32_t seq;               // order of arrival on its channel
+    Shared<Future<bool>> done;
+    Request* next = nullptr;
+};
+
+// Reads are waited on, writes can wait a lot longer
+constexpr static uint32_t READ_DEADLINE = 500;
+constexpr static uint32_t WRITE_DEADLINE = 5000;
+
+// One command at a time per controller, master and slave share the
+// registers. Each controller has a queue of requests and a thread that
+// serves them.
+struct Channel {
+    BlockingLock lock{};            // held while a command runs
+    Semaphore done{0};              // upped by the interrupt handler
+    Atomic<bool> waiting{false};    // somebody wants the next interrupt
+    volatile uint8_t status = 0;    // what the drive said when it interrupted
+
+    InterruptSafeLock qLock{};
+    Request* queue = nullptr;       // sorted by sector
+    Semaphore pending{0};           // one up per request
+    uint32_t head = 0;              // where the last command ended
+    uint32_t seq = 0;               // for the next request
+};
+
+static Channel channels[2];
+
+// ISA IRQ lines and the vectors we put them on
+static uint32_t irqs[2] = { 14, 15 };
+static uint32_t vectors[2] = { 46, 47 };
+
+static void probeDma();
+static void serve(uint32_t controller);
+
+static Atomic<bool> initDone{false};
+
+static void init() {
+    if (initDone.exchange(true)) return;
+
+    IDT::interrupt(vectors[0], (uint32_t) ideHandler0_);
+    IDT::interrupt(vectors[1], (uint32_t) ideHandler1_);
+    for (uint32_t i = 0; i < 2; i++) {
+        IOAPIC::route(irqs[i], vectors[i], SMP::me());
+    }
+
+    probeDma();
+
+    for (uint32_t i = 0; i < 2; i++) {
+        thread([i] {
+            serve(i);
+        });
+    }
+}
+
+extern "C" void ideHandler(uint32_t controller) {
+    // interrupts are disabled
+    auto& ch = channels[controller];
+    ch.status = inb(ports[controller] + 7);     // acknowledges the interrupt
+    SMP::eoi();
+    if (ch.waiting.exchange(false)) {
+        ch.done.up();
+    }
+}
+
+// Call before doing whatever makes the drive interrupt
+static inline void expectInterrupt(uint32_t drive) {
+    channels[controller(drive)].waiting.set(true);
+}
+
+// Blocks until the interrupt comes, returns the drive status
+static uint8_t waitForInterrupt(uint32_t drive) {
+    auto& ch = channels[controller(drive)];
+    ch.done.down();
+    auto status = ch.status;
+    if ((status & (ERR | DF)) != 0) {
+        Debug::panic("drive error, device:%x, status:%x",drive,status);
+    }
+    return status;
+}
+
+
+////////////////////
+// bus master DMA //
+////////////////////
+
+// The PIIX IDE function (what QEMU emulates) has one set of bus master
+// registers per controller. The drive walks a table of physical regions
+// (PRDs) and moves the data by itself.
+
+struct PRD {
+    uint32_t addr;          // physical, even
+    uint16_t bytes;         // 0 -> 64KB
+    uint16_t flags;
+} __attribute__((packed));
+
+constexpr static uint16_t PRD_EOT = 0x8000;    // last entry
+constexpr static uint32_t PRD_MAX = PhysMem::FRAME_SIZE / sizeof(PRD);
+
+// Bus master registers (offsets from the controller's base)
+#define BM_CMD      0
+#define BM_STATUS   2
+#define BM_PRDT     4
+
+#define BM_START    0x01
+#define BM_READ     0x08    // device to memory
+#define BM_ACTIVE   0x01
+#define BM_ERR      0x02
+#define BM_IRQ      0x04
+#define BM_CAPABLE  0x60    // "drive can do DMA" bits, set by the BIOS
+
+struct BusMaster {
+    uint32_t base = 0;      // 0 -> no DMA, use PIO
+    PRD* prdt = nullptr;    // one frame, so it never crosses 64KB
+};
+
+static BusMaster busMasters[2];
+
+// device control ports, for the software reset
+static int controls[2] = { 0x3f6, 0x376 };
+
+static void probeDma() {
+    uint32_t bus, dev, func;
+    if (!pci_find_class(0x01, 0x01, bus, dev, func)) return;    // mass storage, IDE
+
+    auto cls = pci_read_config_dword(bus, dev, func, 0x08);
+    if ((cls & 0x8000) == 0) return;                // prog-if bit 7: bus master
+
+    auto bar4 = pci_read_config_dword(bus, dev, func, 0x20);
+    if ((bar4 & 1) == 0) return;                    // we want I/O space
+    uint32_t base = bar4 & 0xFFFC;
+
+    // enable I/O decoding and bus mastering
+    auto cmd = pci_read_config_dword(bus, dev, func, 0x04);
+    pci_write_config_dword(bus, dev, func, 0x04, (cmd & 0xFFFF) | 0x5);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        busMasters[i].prdt = (PRD*) PhysMem::alloc_frame(true);
+        busMasters[i].base = base + i * 8;
     }
 
-    for (uint32_t i=0; i<block_size/sizeof(uint32_t); i++) {
-        ptr[i] = inl(base);
+    Debug::printf("| IDE bus master DMA at 0x%x\n",base);
+}
+
+// Direct DMA needs identity mapped, even addresses
+static bool canDma(uint32_t drive, Request* batch) {
+    if (busMasters[controller(drive)].base == 0) return false;
+    if (!identities[drive].dma) return false;
+    for (auto r = batch; r != nullptr; r = r->next) {
+        uint32_t pa = (uint32_t) r->buffer;
+        uint32_t bytes = r->count * 512;
+        if ((pa & 1) != 0) return false;
+        if ((pa + bytes > PhysMem::LOW_LIMIT) || (pa + bytes < pa)) return false;
     }
+    return true;
 }
 
-void Ide::writeSector(uint32_t sector, const void* buffer) {
-    LockGuard g{lock};
-    const uint32_t* ptr = (const uint32_t*) buffer;
+static void resetController(uint32_t drive) {
+    auto ctl = controls[controller(drive)];
+    outb(ctl, 0x04);        // SRST
+    for (int i = 0; i < 1000; i++) pause();
+    outb(ctl, 0x00);
+    while ((getStatus(drive) & BSY) != 0) {
+        pause();
+    }
+}
+
+// LBA28 reaches the first 128GB, the rest needs the 48 bit commands
+constexpr static uint64_t LBA28_LIMIT = uint64_t(1) << 28;
+
+static inline bool extended(uint32_t drive, uint32_t sector, uint32_t n) {
+    if (uint64_t(sector) + n <= LBA28_LIMIT) return false;
+    if (!identities[drive].lba48) {
+        Debug::panic("drive %x can't reach sector %u\n",drive,sector + n - 1);
+    }
+    return true;
+}
 
-    nWrite += 1;
+// Programs the task file for a transfer of "n" sectors (1..256) and
+// issues "cmd", the 48 bit form goes through the registers twice
+static void command(uint32_t drive, uint32_t sector, uint32_t n, bool ext, uint8_t cmd) {
     int base = port(drive);
     int ch = channel(drive);
 
     waitForDrive(drive);
 
-    outb(base + 2, 1);          // sector count
-    outb(base + 3, sector >> 0);    // bits 7 .. 0
-    outb(base + 4, sector >> 8);    // bits 15 .. 8
-    outb(base + 5, sector >> 16);   // bits 23 .. 16
-    outb(base + 6, 0xE0 | (ch << 4) | ((sector >> 24) & 0xf));
-    outb(base + 7, 0x30);       // write
+    if (ext) {
+        outb(base + 2, (n >> 8) & 0xff);    // sector count 15 .. 8
+        outb(base + 3, sector >> 24);       // bits 31 .. 24
+        outb(base + 4, 0);                  // bits 39 .. 32
+        outb(base + 5, 0);                  // bits 47 .. 40
+        outb(base + 2, n & 0xff);           // sector count 7 .. 0
+        outb(base + 3, sector >> 0);        // bits 7 .. 0
+        outb(base + 4, sector >> 8);        // bits 15 .. 8
+        outb(base + 5, sector >> 16);       // bits 23 .. 16
+        outb(base + 6, 0x40 | (ch << 4));
+    } else {
+        outb(base + 2, n & 0xff);       // sector count (0 -> 256)
+        outb(base + 3, sector >> 0);    // bits 7 .. 0
+        outb(base + 4, sector >> 8);    // bits 15 .. 8
+        outb(base + 5, sector >> 16);   // bits 23 .. 16
+        outb(base + 6, 0xE0 | (ch << 4) | ((sector >> 24) & 0xf));
+    }
+    outb(base + 7, cmd);
+}
+
+// Polls until BSY goes away, returns the last status
+static uint8_t settle(uint32_t drive) {
+    uint8_t status;
+    while (((status = getStatus(drive)) & BSY) != 0) {
+        pause();
+    }
+    return status;
+}
+
+// IDENTIFY DEVICE (polled, the interrupt is ignored). Fills identities[drive],
+// turns on READ/WRITE MULTIPLE if the drive has it
+static void identify(uint32_t drive) {
+    auto& id = identities[drive];
+    int base = port(drive);
+
+    id = Identity{};
 
+    LockGuard g{channels[controller(drive)].lock};
+
+    outb(base + 6, 0xA0 | (channel(drive) << 4));
+    for (int i = 0; i < 4; i++) inb(controls[controller(drive)]);   // 400ns
+
+    // a floating bus reads as all ones
+    auto status = getStatus(drive);
+    if ((status == 0) || (status == 0xFF)) return;
+
+    outb(base + 2, 0);
+    outb(base + 3, 0);
+    outb(base + 4, 0);
+    outb(base + 5, 0);
+    outb(base + 7, 0xEC);
+    if (getStatus(drive) == 0) return;
+    settle(drive);
+
+    // ATAPI devices abort and leave their signature here
+    if ((inb(base + 4) != 0) || (inb(base + 5) != 0)) return;
+    while (((status = getStatus(drive)) & (DRQ | ERR)) == 0) {
+        pause();
+    }
+    if ((status & ERR) != 0) return;
+
+    uint32_t data[128];
+    for (uint32_t i = 0; i < 128; i++) {
+        data[i] = inl(base);
+    }
+    auto words = (uint16_t*) data;
+
+    if ((words[49] & (1 << 9)) == 0) return;    // no LBA, we don't do CHS
+
+    id.sectors = words[60] | (uint32_t(words[61]) << 16);
+    id.lba48 = (words[83] & (1 << 10)) != 0;
+    if (id.lba48) {
+        id.sectors = uint64_t(words[100]) | (uint64_t(words[101]) << 16) |
+                     (uint64_t(words[102]) << 32) | (uint64_t(words[103]) << 48);
+    }
+    id.dma = (words[49] & (1 << 8)) != 0;
+    id.present = true;
+
+    if (driveStats[drive] == nullptr) {
+        char name[] = "hda";
+        name[2] = 'a' + drive;
+        driveStats[drive] = new IoStats(name);
+    }
+
+    // SET MULTIPLE MODE, at most 16 so a block never gets too big
+    uint32_t multiple = K::min(uint32_t(words[47] & 0xFF), uint32_t(16));
+    if (multiple > 1) {
+        outb(base + 2, multiple);
+        outb(base + 7, 0xC6);
+        if ((settle(drive) & (ERR | DF)) == 0) {
+            id.multiple = multiple;
+        }
+    }
+
+    Debug::printf("| IDE drive %d: %u sectors%s%s, %u per interrupt\n",
+        drive, uint32_t(id.sectors), id.lba48 ? ", LBA48" : "", id.dma ? ", DMA" : "",
+        K::max(id.multiple, uint32_t(1)));
+}
+
+// The drive raises DRQ once per sector
+static void waitForData(uint32_t drive) {
     waitForDrive(drive);
 
     while ((getStatus(drive) & DRQ) == 0) {
         pause();
     }
+}
 
-    for (uint32_t i=0; i < block_size / sizeof(uint32_t); i++) {
-        outl(base,ptr[i]);
+// Moves the batch (consecutive sectors, scattered buffers) with bus
+// master DMA. Returns false (and turns DMA off for the controller) if
+// it failed
+static bool dmaTransfer(Request* batch, uint32_t n) {
+    auto drive = batch->drive;
+    auto write = batch->write;
+    auto& bm = busMasters[controller(drive)];
+
+    // one PRD per piece, pieces can't cross a 64KB boundary
+    uint32_t i = 0;
+    for (auto r = batch; r != nullptr; r = r->next) {
+        uint32_t pa = (uint32_t) r->buffer;
+        uint32_t left = r->count * 512;
+        while (left > 0) {
+            ASSERT(i < PRD_MAX);
+            auto bytes = K::min(left, 0x10000 - (pa & 0xFFFF));
+            bm.prdt[i].addr = pa;
+            bm.prdt[i].bytes = bytes & 0xFFFF;
+            bm.prdt[i].flags = 0;
+            pa += bytes;
+            left -= bytes;
+            i += 1;
+        }
+    }
+    bm.prdt[i-1].flags = PRD_EOT;
+
+    outb(bm.base + BM_CMD, 0);
+    outl(bm.base + BM_PRDT, (uint32_t) bm.prdt);
+    // writing 1s clears the error and interrupt bits
+    outb(bm.base + BM_STATUS, (inb(bm.base + BM_STATUS) & BM_CAPABLE) | BM_ERR | BM_IRQ);
+    outb(bm.base + BM_CMD, write ? 0 : BM_READ);
+
+    auto ext = extended(drive, batch->sector, n);
+    expectInterrupt(drive);
+    if (write) {
+        command(drive, batch->sector, n, ext, ext ? 0x35 : 0xCA);    // WRITE DMA (EXT)
+    } else {
+        command(drive, batch->sector, n, ext, ext ? 0x25 : 0xC8);    // READ DMA (EXT)
     }
 
-    waitForDrive(drive);
+    outb(bm.base + BM_CMD, (write ? 0 : BM_READ) | BM_START);
+
+    // the drive interrupts when it's done, we sleep until then
+    auto& ch = channels[controller(drive)];
+    ch.done.down();
+    auto status = ch.status;
 
-    //outb(base + 7, 0xE7); // flush buffers
+    outb(bm.base + BM_CMD, 0);
+    uint8_t st = inb(bm.base + BM_STATUS);
+    outb(bm.base + BM_STATUS, (st & BM_CAPABLE) | BM_ERR | BM_IRQ);
 
-    //waitForDrive(drive);
+    if (((st & BM_ERR) != 0) || ((status & (ERR | DF)) != 0)) {
+        Debug::printf("| IDE DMA failed, drive:%x bm:%x status:%x, using PIO\n",drive,st,status);
+        bm.base = 0;
+        resetController(drive);
+        return false;
+    }
 
+    return true;
 }
 
-int32_t Ide::write(uint32_t offset, const void* buffer, uint32_t n) {
-    if (block_size != 512) {
-        Debug::panic("invalid sector size: %u\n", block_size);
+// Where sector "s" of the batch goes
+static uint32_t* sectorBuffer(Request* batch, uint32_t s) {
+    auto r = batch;
+    while (s >= r->count) {
+        s -= r->count;
+        r = r->next;
     }
-    uint32_t sector = offset / block_size;
-    uint32_t start = offset % block_size;
+    return (uint32_t*) (r->buffer + s * 512);
+}
 
-    uint32_t end = start + n;
-    if (end > block_size) end = block_size;
+// With READ/WRITE MULTIPLE the drive interrupts once per block of
+// "multiple" sectors instead of once per sector
+static void pioTransfer(Request* batch, uint32_t n) {
+    auto drive = batch->drive;
+    int base = port(drive);
+    constexpr uint32_t words = 512 / sizeof(uint32_t);
+
+    auto ext = extended(drive, batch->sector, n);
+    auto multiple = identities[drive].multiple;
+    auto per = (multiple == 0) ? 1 : multiple;
+
+    if (!batch->write) {
+        expectInterrupt(drive);
+        if (multiple != 0) {
+            command(drive,batch->sector,n,ext,ext ? 0x29 : 0xC4);  // READ MULTIPLE (EXT)
+        } else {
+            command(drive,batch->sector,n,ext,ext ? 0x24 : 0x20);  // READ SECTORS (EXT)
+        }
+
+        // one interrupt per block, when its data is ready
+        for (uint32_t s = 0; s < n; s += per) {
+            waitForInterrupt(drive);
+            waitForData(drive);
+            auto k = K::min(per, n - s);
+            if (s + k < n) expectInterrupt(drive);
+            for (uint32_t j = 0; j < k; j++) {
+                auto ptr = sectorBuffer(batch,s + j);
+                for (uint32_t i=0; i<words; i++) {
+                    ptr[i] = inl(base);
+                }
+            }
+        }
+    } else {
+        if (multiple != 0) {
+            command(drive,batch->sector,n,ext,ext ? 0x39 : 0xC5);  // WRITE MULTIPLE (EXT)
+        } else {
+            command(drive,batch->sector,n,ext,ext ? 0x34 : 0x30);  // WRITE SECTORS (EXT)
+        }
+
+        // the first block goes right away, then one interrupt
+        // after each block is written
+        for (uint32_t s = 0; s < n; s += per) {
+            waitForData(drive);
+            expectInterrupt(drive);
+            auto k = K::min(per, n - s);
+            for (uint32_t j = 0; j < k; j++) {
+                auto ptr = sectorBuffer(batch,s + j);
+                for (uint32_t i=0; i < words; i++) {
+                    outl(base,ptr[i]);
+                }
+            }
+            waitForInterrupt(drive);
+        }
+    }
+}
 
-    uint32_t count = end - start;
-    
-    if (count == block_size) {
-        // whole sector
-        writeSector(sector,buffer);
-    } else if (count != 0) {
-        char data[block_size];
-        read_block(sector,data);
-        memcpy(&data[start],buffer,count);
-        writeSector(sector,data);
+///////////////////
+// the elevator  //
+///////////////////
+
+// Picks the next batch (call with qLock held):
+//    - a request that is past its deadline goes first
+//    - otherwise C-SCAN: the lowest sector at or after the head, and
+//      back to the lowest sector when we run off the end
+//    - requests for the following sectors (same drive and direction)
+//      join the batch, up to what a command can do
+//    - a flush is a barrier: nothing that came after it goes before it,
+//      and it waits until everything that came before it is done
+static Request* pick(Channel& ch, uint32_t& n) {
+    // the flush that came first, and what came before it
+    Request* barrier = nullptr;
+    for (auto r = ch.queue; r != nullptr; r = r->next) {
+        if (r->flush && ((barrier == nullptr) || (int32_t(r->seq - barrier->seq) < 0))) barrier = r;
+    }
+    auto ahead = [barrier](Request* r) {
+        return (barrier == nullptr) || (int32_t(r->seq - barrier->seq) < 0);
+    };
+
+    Request* first = nullptr;
+    Request* lowest = nullptr;
+    Request* oldest = nullptr;
+    for (auto r = ch.queue; r != nullptr; r = r->next) {
+        if (!ahead(r)) continue;
+        if (lowest == nullptr) lowest = r;
+        if ((first == nullptr) && (r->sector >= ch.head)) first = r;
+        if ((oldest == nullptr) || (int32_t(r->deadline - oldest->deadline) < 0)) oldest = r;
+    }
+    if (first == nullptr) first = lowest;
+    if ((oldest != nullptr) && (int32_t(Pit::jiffies - oldest->deadline) >= 0)) first = oldest;
+    // batches go one at a time, so everything before the flush is done
+    if (first == nullptr) first = barrier;
+    if (first == nullptr) return nullptr;
+
+    Request* batch = nullptr;
+    Request* tail = nullptr;
+    n = 0;
+
+    auto take = [&ch,&batch,&tail,&n](Request* r) {
+        auto pp = &ch.queue;
+        while (*pp != r) pp = &(*pp)->next;
+        *pp = r->next;
+        r->next = nullptr;
+        if (tail == nullptr) batch = r; else tail->next = r;
+        tail = r;
+        n += r->count;
+    };
+
+    take(first);
+
+    bool more = true;
+    while (more) {
+        more = false;
+        auto end = batch->sector + n;
+        for (auto r = ch.queue; r != nullptr; r = r->next) {
+            if (r->sector > end) break;
+            if ((r->sector == end) && (r->drive == batch->drive) && !r->flush && !batch->flush && ahead(r) &&
+                (r->write == batch->write) && (n + r->count <= Ide::max_sectors)) {
+                take(r);
+                driveStats[r->drive]->merged();
+                more = true;
+                break;
+            }
+        }
+    }
+
+    ch.head = batch->sector + n;
+    return batch;
+}
+
+// The I/O thread for a controller
+static void serve(uint32_t controller) {
+    auto& ch = channels[controller];
+    while (true) {
+        ch.pending.down();
+
+        Request* batch;
+        uint32_t n = 0;
+        {
+            LockGuard g{ch.qLock};
+            batch = pick(ch,n);
+        }
+        // merged requests leave extra ups behind
+        if (batch == nullptr) continue;
+
+        auto stats = driveStats[batch->drive];
+
+        if (batch->flush) {
+            LockGuard g{ch.lock};
+            auto ext = identities[batch->drive].lba48;
+            auto start = rdtsc();
+            expectInterrupt(batch->drive);
+            command(batch->drive,0,0,false,ext ? 0xEA : 0xE7);     // FLUSH CACHE (EXT)
+            waitForInterrupt(batch->drive);
+            auto end = rdtsc();
+            stats->command(true,0,false,end - start);
+            stats->completed(end - batch->submitted);
+            batch->done->set(true);
+            delete batch;
+            continue;
+        }
+
+        uint64_t start;
+        uint64_t end;
+        bool dma;
+        {
+            LockGuard g{ch.lock};
+            start = rdtsc();
+            dma = canDma(batch->drive,batch) && dmaTransfer(batch,n);
+            if (!dma) {
+                pioTransfer(batch,n);
+            }
+            end = rdtsc();
+        }
+        stats->command(batch->write,n * 512,dma,end - start);
+
+        while (batch != nullptr) {
+            auto r = batch;
+            batch = r->next;
+            stats->completed(end - r->submitted);
+            r->done->set(true);
+            delete r;
+        }
+    }
+}
+
+static void enqueue(Request* r) {
+    auto& ch = channels[controller(r->drive)];
+    {
+        LockGuard g{ch.qLock};
+        r->submitted = rdtsc();
+        r->seq = ch.seq++;
+        driveStats[r->drive]->submitted();
+        auto pp = &ch.queue;
+        while ((*pp != nullptr) && ((*pp)->sector <= r->sector)) pp = &(*pp)->next;
+        r->next = *pp;
+        *pp = r;
+    }
+    ch.pending.up();
+}
+
+void Ide::flush_cache() {
+    init();
+    if (!exists()) return;
+
+    // pick() doesn't move it ahead of the writes that were queued before
+    // it, or move later ones ahead of it
+    auto r = new Request();
+    r->drive = drive;
+    r->write = true;
+    r->flush = true;
+    r->sector = 0;
+    r->count = 0;
+    r->buffer = nullptr;
+    r->deadline = Pit::jiffies + WRITE_DEADLINE;
+    r->done = Shared<Future<bool>>::make();
+    auto done = r->done;
+    enqueue(r);
+    done->get();
+}
+
+Shared<Future<bool>> Ide::submit(bool write, uint32_t sector, uint32_t count, char* buffer) {
+    init();
+    ASSERT((count > 0) && (count <= max_sectors));
+    if (uint64_t(sector) + count > identities[drive].sectors) {
+        // nothing moves, the future says so
+        Debug::printf("| IDE drive %x has %u sectors, asked for %u..%u\n",
+            drive, uint32_t(identities[drive].sectors), sector, sector + count - 1);
+        auto failed = Shared<Future<bool>>::make();
+        failed->set(false);
+        return failed;
+    }
+
+    auto r = new Request();
+    r->drive = drive;
+    r->write = write;
+    r->flush = false;
+    r->sector = sector;
+    r->count = count;
+    r->buffer = buffer;
+    r->deadline = Pit::jiffies + (write ? WRITE_DEADLINE : READ_DEADLINE);
+    r->done = Shared<Future<bool>>::make();
+    auto done = r->done;
+    enqueue(r);
+    return done;
+}
+
+// Everything is queued before we wait so the elevator sees it all
+void Ide::transfer(bool write, uint32_t sector, uint32_t count, char* buffer) {
+    auto n = (count + max_sectors - 1) / max_sectors;
+    auto pieces = new Shared<Future<bool>>[n];
+    for (uint32_t i = 0; i < n; i++) {
+        auto c = K::min(count - i * max_sectors, max_sectors);
+        pieces[i] = submit(write, sector + i * max_sectors, c, buffer + i * max_sectors * block_size);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        pieces[i]->get();
+    }
+    delete[] pieces;
+}
+
+void Ide::read_blocks(uint32_t sector, uint32_t count, char* buffer) {
+    transfer(false,sector,count,buffer);
+}
+
+void Ide::write_blocks(uint32_t sector, uint32_t count, const char* buffer) {
+    transfer(true,sector,count,(char*) buffer);
+}
+
+void Ide::read_part(uint32_t sector, uint32_t offset, uint32_t n, char* buffer) {
+    BCache::read(this,sector * sector_size + offset,n,buffer);
+}
+
+int64_t Ide::read(uint32_t offset, uint32_t n, char* buffer) {
+    auto sz = size_in_bytes();
+    if (offset > sz) return -1;
+    n = K::min(n,sz - offset);
+    // runs that miss still go from the drive to "buffer" in one transfer
+    BCache::read(this,offset,n,buffer);
+    return n;
+}
+
+int32_t Ide::write(uint32_t offset, const void* buffer, uint32_t n) {
+    // up to the end of the sector, like it always did
+    uint32_t start = offset % block_size;
+    uint32_t count = K::min(n,block_size - start);
+    if (count != 0) {
+        // the cache merges it with the rest of the sector (no read-modify-
+        // write here) and the flusher writes it back
+        BCache::write(this,offset,(const char*) buffer,count);
     }
     return count;
 }
 
 
 void ideStats(void) {
-    Debug::printf("nRead %d\n",nRead);
-    Debug::printf("nWrite %d\n",nWrite);
+    IoStats::print();
+    Debug::printf("cache hits %d\n",BCache::hits());
+    Debug::printf("cache misses %d\n",BCache::misses());
+    Debug::printf("cache dirty %d\n",BCache::dirty());
+    Debug::printf("cache prefetched %d\n",BCache::prefetched());
 }
\ No newline at end of file
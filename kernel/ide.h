@@ -6,6 +6,8 @@
 #include "atomic.h"
 #include "shared.h"
 
+template <typename T> class Future;
+
 // Simple (way too simple) device driver for IDE devices (mostly disks)
 //
 // IDE (integrated device electronics) is the original standard for
@@ -21,32 +23,69 @@ class Ide : public BlockIO {  // We are a block device
     
     uint32_t drive; /* 0 -> A, 1 -> B, 2 -> C, 3 -> D */
 
-    InterruptSafeLock lock;
-
-    Atomic<uint32_t> ref_count;
+    // queues the pieces of a large transfer and waits for all of them
+    void transfer(bool write, uint32_t sector, uint32_t count, char* buffer);
 
 public:
-    Ide(uint32_t drive) : BlockIO(sector_size), drive(drive), ref_count(0) {}
+    // The sector count register is 8 bits, 0 means 256
+    constexpr static uint32_t max_sectors = 256;
+
+    // Asks the drive what it is (IDENTIFY DEVICE)
+    Ide(uint32_t drive);
+
+    virtual ~Ide();
 
-    virtual ~Ide() {}
+    // false if there is no drive attached
+    bool exists();
     
     // Read the given block into the given buffer. We assume the
     // buffer is big enough
-    void read_block(uint32_t block_number, char* buffer) override;
+    void read_block(uint32_t block_number, char* buffer) override {
+        read_blocks(block_number,1,buffer);
+    }
+
+    void writeSector(uint32_t sector, const void* buffer) {
+        write_blocks(sector,1,(const char*) buffer);
+    }
+
+    void write_block(uint32_t sector, const char* buffer) override {
+        write_blocks(sector,1,buffer);
+    }
+
+    // Queues a transfer of up to max_sectors sectors and returns right
+    // away. The future is set when the data has moved. Requests are
+    // served by the controller's I/O thread, sorted by sector and merged
+    // with their neighbors. A request past the end of the drive isn't
+    // queued, its future is set to false
+    Shared<Future<bool>> submit(bool write, uint32_t sector, uint32_t count, char* buffer);
+
+    // FLUSH CACHE, waits for it. It covers every write submitted before
+    // it, later requests wait for it
+    void flush_cache() override;
+
+    // One command for every (up to) 256 sectors
+    void read_blocks(uint32_t first, uint32_t count, char* buffer) override;
+    void write_blocks(uint32_t first, uint32_t count, const char* buffer) override;
 
-    void writeSector(uint32_t sector, const void* buffer);
+    // Partial sectors come out of the buffer cache
+    void read_part(uint32_t block_number, uint32_t offset, uint32_t n, char* buffer) override;
 
+    // So do whole ones, the cache can have newer data than the drive
+    int64_t read(uint32_t offset, uint32_t n, char* buffer) override;
+
+    // Writes what fits in the sector under "offset" through the buffer
+    // cache, returns how much that was
     int32_t write(uint32_t offset, const void* buffer, uint32_t n);
 
-    // We lie because I'm too lazy to get the actual drive size
-    // This means that we'll get QEMU errors if we try to access
-    // non existent blocks.
-    uint32_t size_in_bytes() {
-        // This is not correct
-        return ~(uint32_t(0));
-    }
+    // nullptr if there is no drive
+    IoStats* stats() override;
+
+    // The capacity IDENTIFY reported, 0 if there is no drive
+    uint64_t size_in_sectors();
+
+    // Same in bytes, capped to what 32 bit offsets can reach
+    uint32_t size_in_bytes() override;
 
-    friend class Shared<Ide>;
 };
 
 #endif
@@ -17,6 +17,7 @@
 #include "tss.h"
 #include "sys.h"
 #include "keyboard.h"
+#include "libk.h"
 
 struct Stack {
     static constexpr int BYTES = 4096;
@@ -87,6 +88,9 @@ extern "C" void kernelInit(void) {
         Debug::printf("| memSize 0x%x %dMB\n",
             kConfig.memSize,
             kConfig.memSize / (1024 * 1024));
+        if (kConfig.highMemSize != 0) {
+            Debug::printf("| highMemSize %dMB\n",uint32_t(kConfig.highMemSize >> 20));
+        }
         Debug::printf("| localAPIC %x\n",kConfig.localAPIC);
         Debug::printf("| ioAPIC %x\n",kConfig.ioAPIC);
 
@@ -101,7 +105,14 @@ extern "C" void kernelInit(void) {
         CRT::init();
 
         /* initialize physmem */
-        PhysMem::init(VMM_FRAMES, kConfig.memSize - VMM_FRAMES);
+        auto lowEnd = K::min(kConfig.memSize, PhysMem::LOW_LIMIT);
+        PhysMem::init(VMM_FRAMES, lowEnd - VMM_FRAMES);
+
+        /* whatever doesn't fit in the identity map is high memory */
+        PhysMem::init_high(lowEnd, kConfig.memSize - lowEnd);
+#if PAE
+        PhysMem::init_high(uint64_t(1) << 32, kConfig.highMemSize);
+#endif
 
         /* initialize VMM */
         VMM::global_init();
@@ -112,6 +123,9 @@ extern "C" void kernelInit(void) {
         /* initialize the thread module */
         threadsInit();
 
+        /* start the frame reclaimer */
+        PhysMem::start_reclaimer();
+
         /* initialize LAPIC */
         SMP::init(true);
         smpInitDone = true;
@@ -0,0 +1,33 @@
+#include "ioapic.h"
+#include "config.h"
+#include "atomic.h"
+
+namespace IOAPIC {
+
+    // index/data register pair
+    constexpr static uint32_t IOREGSEL = 0x00;
+    constexpr static uint32_t IOWIN = 0x10;
+
+    constexpr static uint32_t REDTBL = 0x10;     // 2 registers per line
+    constexpr static uint32_t MASKED = 1 << 16;
+
+    static InterruptSafeLock lock{};
+
+    static void write(uint32_t reg, uint32_t value) {
+        *((volatile uint32_t*) (kConfig.ioAPIC + IOREGSEL)) = reg;
+        *((volatile uint32_t*) (kConfig.ioAPIC + IOWIN)) = value;
+    }
+
+    void route(uint32_t irq, uint32_t vector, uint32_t apicId) {
+        LockGuard g{lock};
+        write(REDTBL + 2 * irq, MASKED);
+        write(REDTBL + 2 * irq + 1, apicId << 24);
+        // fixed delivery, physical destination, active high, edge triggered
+        write(REDTBL + 2 * irq, vector);
+    }
+
+    void mask(uint32_t irq) {
+        LockGuard g{lock};
+        write(REDTBL + 2 * irq, MASKED);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef _IOAPIC_H_
+#define _IOAPIC_H_
+
+#include "stdint.h"
+
+//
+// The I/O APIC routes device interrupt lines to local APICs
+//
+// We only deal with ISA style lines (edge triggered, active high) and
+// assume they are not remapped (true for the IDE lines under QEMU)
+//
+namespace IOAPIC {
+
+    // Sends "irq" to "vector" on the core with the given APIC id
+    void route(uint32_t irq, uint32_t vector, uint32_t apicId);
+
+    void mask(uint32_t irq);
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include "iostat.h"
+#include "debug.h"
+#include "libk.h"
+#include "machine.h"
+
+static IoStats* devices[IoStats::MAX_DEVICES];
+static InterruptSafeLock devicesLock{};
+
+IoStats::IoStats(const char* name) : counts() {
+    uint32_t i = 0;
+    while ((i < sizeof(counts.name) - 1) && (name[i] != 0)) {
+        counts.name[i] = name[i];
+        i += 1;
+    }
+    counts.name[i] = 0;
+
+    LockGuard g{devicesLock};
+    for (i = 0; i < MAX_DEVICES; i++) {
+        if (devices[i] == nullptr) {
+            devices[i] = this;
+            return;
+        }
+    }
+    // still counts, it just can't be seen
+}
+
+IoStats::~IoStats() {
+    LockGuard g{devicesLock};
+    for (uint32_t i = 0; i < MAX_DEVICES; i++) {
+        if (devices[i] == this) devices[i] = nullptr;
+    }
+}
+
+uint32_t IoStats::bucket(uint64_t cycles) {
+    if (cycles == 0) return 0;
+    return K::min(uint32_t(63 - __builtin_clzll(cycles)), BUCKETS - 1);
+}
+
+void IoStats::submitted() {
+    LockGuard g{lock};
+    counts.requests += 1;
+    counts.queued += 1;
+    if (counts.queued > counts.maxQueued) counts.maxQueued = counts.queued;
+}
+
+void IoStats::merged() {
+    LockGuard g{lock};
+    counts.merged += 1;
+}
+
+void IoStats::hit() {
+    LockGuard g{lock};
+    counts.cacheHits += 1;
+}
+
+void IoStats::miss() {
+    LockGuard g{lock};
+    counts.cacheMisses += 1;
+}
+
+void IoStats::command(bool write, uint32_t bytes, bool dma, uint64_t cycles) {
+    LockGuard g{lock};
+    if (bytes == 0) {
+        counts.flushes += 1;
+    } else if (write) {
+        counts.writes += 1;
+        counts.bytesWritten += bytes;
+    } else {
+        counts.reads += 1;
+        counts.bytesRead += bytes;
+    }
+    if (dma) counts.dma += 1;
+    counts.serviceTime[bucket(cycles)] += 1;
+}
+
+void IoStats::completed(uint64_t cycles) {
+    LockGuard g{lock};
+    counts.queued -= 1;
+    counts.waitTime[bucket(cycles)] += 1;
+}
+
+bool IoStats::get(uint32_t i, iostat& out) {
+    if (i >= MAX_DEVICES) return false;
+    LockGuard g{devicesLock};
+    auto s = devices[i];
+    if (s == nullptr) return false;
+    LockGuard g2{s->lock};
+    out = s->counts;
+    return true;
+}
+
+void IoStats::print() {
+    for (uint32_t i = 0; i < MAX_DEVICES; i++) {
+        iostat s;
+        if (!get(i,s)) continue;
+        Debug::printf("%s: %u reads (%u KB), %u writes (%u KB), %u flushes, %u DMA\n",
+            s.name, s.reads, uint32_t(s.bytesRead >> 10), s.writes, uint32_t(s.bytesWritten >> 10),
+            s.flushes, s.dma);
+        Debug::printf("%s: %u requests, %u merged, %u queued (max %u), cache %u hits %u misses\n",
+            s.name, s.requests, s.merged, s.queued, s.maxQueued, s.cacheHits, s.cacheMisses);
+        Debug::printf("%s: log2(cycles) service/wait:", s.name);
+        for (uint32_t b = 0; b < BUCKETS; b++) {
+            if ((s.serviceTime[b] != 0) || (s.waitTime[b] != 0)) {
+                Debug::printf(" %u:%u/%u", b, s.serviceTime[b], s.waitTime[b]);
+            }
+        }
+        Debug::printf("\n");
+    }
+}
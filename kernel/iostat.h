@@ -0,0 +1,70 @@
+#ifndef _IOSTAT_H_
+#define _IOSTAT_H_
+
+#include "stdint.h"
+#include "atomic.h"
+
+// What the iostat system call copies out, user programs have the same
+// struct in sys.h
+struct iostat {
+    char name[8];
+    uint32_t reads;             // commands
+    uint32_t writes;
+    uint32_t flushes;
+    uint32_t dma;               // commands that used DMA
+    uint32_t requests;          // what was asked for, before merging
+    uint32_t merged;            // requests that went out with another one
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint32_t queued;            // requests waiting or running now
+    uint32_t maxQueued;
+    uint32_t cacheHits;
+    uint32_t cacheMisses;
+    uint32_t serviceTime[32];   // command took [2^i,2^(i+1)) TSC cycles
+    uint32_t waitTime[32];      // same, from submit to done
+};
+
+//
+// Per-device I/O statistics
+//
+// Block devices that move data (drives, ram disks) have one and it
+// shows up under its name in the device list. The driver counts the
+// commands and times them with the TSC, the buffer cache counts hits
+// and misses against the device. Latencies go in log2 buckets.
+//
+class IoStats {
+    iostat counts;
+    InterruptSafeLock lock{};
+
+    static uint32_t bucket(uint64_t cycles);
+
+public:
+    constexpr static uint32_t BUCKETS = 32;
+    constexpr static uint32_t MAX_DEVICES = 8;
+
+    // "name" is cut to 7 characters
+    explicit IoStats(const char* name);
+
+    IoStats(const IoStats&) = delete;
+
+    ~IoStats();
+
+    void submitted();
+    void merged();
+    void hit();
+    void miss();
+
+    // a command moved "bytes" (0 for a flush) in "cycles"
+    void command(bool write, uint32_t bytes, bool dma, uint64_t cycles);
+
+    // a request is done, "cycles" after it was submitted
+    void completed(uint64_t cycles);
+
+    // Copies the stats of the i-th device, false if there is none
+    static bool get(uint32_t i, iostat& out);
+
+    // Prints every device
+    static void print();
+};
+
+#endif
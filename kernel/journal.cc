@@ -0,0 +1,631 @@
+#include "journal.h"
+#include "bcache.h"
+#include "threads.h"
+#include "machine.h"
+#include "debug.h"
+#include "libk.h"
+
+// The journal is big-endian
+static uint32_t be(uint32_t x) {
+    return __builtin_bswap32(x);
+}
+
+constexpr uint32_t MAGIC = 0xC03B3998;
+
+// Header::type
+constexpr uint32_t DESCRIPTOR_BLOCK = 1;
+constexpr uint32_t COMMIT_BLOCK = 2;
+constexpr uint32_t SUPER_V1 = 3;
+constexpr uint32_t SUPER_V2 = 4;
+constexpr uint32_t REVOKE_BLOCK = 5;
+
+// the flags of a tag in a descriptor block
+constexpr uint32_t TAG_ESCAPE = 1;      // the block started with MAGIC, it's logged with 0
+constexpr uint32_t TAG_SAME_UUID = 2;   // no UUID after this tag
+constexpr uint32_t TAG_LAST = 8;
+constexpr uint32_t TAG_SIZE = 8;        // block, flags
+constexpr uint32_t UUID_SIZE = 16;
+
+// JournalSuper::featureIncompat, we only know revoke blocks
+constexpr uint32_t INCOMPAT_REVOKE = 1;
+
+// Journal::logged has where the last committed copy of each block is in
+// the log, with this bit if it went there escaped
+constexpr uint32_t ESCAPED = 0x80000000;
+
+// the passes over the log at mount
+constexpr uint32_t SCAN = 0;
+constexpr uint32_t REVOKES = 1;
+constexpr uint32_t REPLAY = 2;
+
+struct Header {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t sequence;      // the transaction
+};
+
+struct JournalSuper {
+    Header header;
+    uint32_t blockSize;
+    uint32_t maxLength;     // in blocks, the log ends here
+    uint32_t first;         // the first block of the log
+    uint32_t sequence;      // the first transaction in the log
+    uint32_t start;         // where it is, 0 if the log is empty
+    uint32_t error;
+    uint32_t featureCompat; // v2 from here on
+    uint32_t featureIncompat;
+    uint32_t featureRoCompat;
+    uint8_t uuid[UUID_SIZE];
+};
+
+//
+// A set of disk blocks with a value for each (open addressing)
+//
+struct BlockSet {
+    uint32_t* keys = nullptr;       // block + 1, 0 for an empty slot
+    uint32_t* values = nullptr;
+    uint32_t size = 0;              // a power of 2
+    uint32_t count = 0;
+
+    BlockSet() {}
+    BlockSet(const BlockSet&) = delete;
+
+    ~BlockSet() {
+        delete[] keys;
+        delete[] values;
+    }
+
+    static uint32_t hash(uint32_t block) {
+        return block * 2654435761u;
+    }
+
+    // the value of "block", nullptr if it's not in the set
+    uint32_t* find(uint32_t block) {
+        if (count == 0) return nullptr;
+        for (uint32_t i = hash(block) & (size - 1); keys[i] != 0; i = (i + 1) & (size - 1)) {
+            if (keys[i] == block + 1) return &values[i];
+        }
+        return nullptr;
+    }
+
+    // adds "block" (with 0) if it isn't there
+    uint32_t& put(uint32_t block) {
+        if (2 * (count + 1) > size) grow();
+        uint32_t i = hash(block) & (size - 1);
+        while ((keys[i] != 0) && (keys[i] != block + 1)) i = (i + 1) & (size - 1);
+        if (keys[i] == 0) {
+            keys[i] = block + 1;
+            values[i] = 0;
+            count += 1;
+        }
+        return values[i];
+    }
+
+    void clear() {
+        if (count == 0) return;
+        bzero(keys, size * 4);
+        count = 0;
+    }
+
+    void grow() {
+        auto oldKeys = keys;
+        auto oldValues = values;
+        auto oldSize = size;
+        size = (size == 0) ? 64 : 2 * size;
+        keys = new uint32_t[size];
+        values = new uint32_t[size];
+        bzero(keys, size * 4);
+        count = 0;
+        for (uint32_t i = 0; i < oldSize; i++) {
+            if (oldKeys[i] != 0) put(oldKeys[i] - 1) = oldValues[i];
+        }
+        delete[] oldKeys;
+        delete[] oldValues;
+    }
+};
+
+// A list of disk blocks
+struct Blocks {
+    uint32_t* at = nullptr;
+    uint32_t n = 0;
+    uint32_t capacity = 0;
+
+    Blocks() {}
+    Blocks(const Blocks&) = delete;
+
+    ~Blocks() {
+        delete[] at;
+    }
+
+    void add(uint32_t block) {
+        if (n == capacity) {
+            capacity = (capacity == 0) ? 16 : 2 * capacity;
+            auto more = new uint32_t[capacity];
+            if (n != 0) memcpy(more, at, n * 4);
+            delete[] at;
+            at = more;
+        }
+        at[n++] = block;
+    }
+
+    bool contains(uint32_t block) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (at[i] == block) return true;
+        }
+        return false;
+    }
+
+    void remove(uint32_t block) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (at[i] == block) {
+                at[i] = at[--n];
+                return;
+            }
+        }
+    }
+};
+
+struct Transaction {
+    const uint32_t tid;
+    BlockSet blocks{};      // where each one went in the log (see ESCAPED)
+    Blocks order{};         // the same blocks, in the order they came in
+    Blocks revokes{};
+
+    explicit Transaction(uint32_t tid) : tid(tid) {}
+
+    bool empty() {
+        return (order.n == 0) && (revokes.n == 0);
+    }
+};
+
+static void header(char* block, uint32_t type, uint32_t tid) {
+    auto h = (Header*) block;
+    h->magic = be(MAGIC);
+    h->type = be(type);
+    h->sequence = be(tid);
+}
+
+Handle::Handle(Ext2* fs) : journal(fs->journal) {
+    if (journal != nullptr) journal->begin();
+}
+
+Handle::~Handle() {
+    if (journal != nullptr) journal->end();
+}
+
+Journal::Journal(Ext2* fs, uint32_t* map, char* super) : fs(fs), bs(fs->get_block_size()), map(map), super(super) {
+    auto js = (JournalSuper*) super;
+    first = be(js->first);
+    last = be(js->maxLength);
+    head = first;
+    running = new Transaction(be(js->sequence));
+    committed = running->tid - 1;
+    logged = new BlockSet();
+    if (be(js->header.type) == SUPER_V2) {
+        js->featureIncompat |= be(INCOMPAT_REVOKE);
+    }
+}
+
+Journal* Journal::open(Ext2* fs) {
+    auto bs = fs->get_block_size();
+    auto node = fs->get_node(fs->superBlock->journalInode);
+    uint32_t n = node->size_in_bytes() / bs;
+
+    auto map = new uint32_t[n];
+    for (uint32_t i = 0; i < n; i++) {
+        map[i] = node->block_address(i);
+        if (map[i] == 0) n = 0;
+    }
+
+    auto super = new char[bs];
+    bzero(super, bs);
+    if (n != 0) fs->read_all(map[0] * bs, bs, super);
+
+    auto js = (JournalSuper*) super;
+    auto type = be(js->header.type);
+    bool good = (n != 0) && (be(js->header.magic) == MAGIC) && ((type == SUPER_V1) || (type == SUPER_V2)) &&
+        (be(js->blockSize) == bs) && (be(js->maxLength) <= n) && (be(js->first) != 0) && (be(js->first) < be(js->maxLength));
+    uint32_t unknown = (type == SUPER_V2) ? be(js->featureIncompat) & ~INCOMPAT_REVOKE : 0;
+    if (!good || (unknown != 0)) {
+        if (good && (js->start != 0)) {
+            Debug::panic("ext2: can't replay a journal with features %x\n", unknown);
+        }
+        Debug::printf("| ext2: can't use the journal in i-node %d\n", fs->superBlock->journalInode);
+        delete[] map;
+        delete[] super;
+        return nullptr;
+    }
+
+    auto journal = new Journal(fs, map, super);
+    journal->replay();
+
+    // the replay can change these
+    fs->read_all(1024, 1024, (char*) fs->superBlock);
+    fs->read_all((fs->superBlock->firstDataBlock + 1) * bs, fs->numBlockGroups * sizeof(BlockGroupDescriptor), (char*) fs->blockGroupTable);
+
+    // like ext3, the log can have something in it until we unmount
+    auto sb = fs->superBlock;
+    uint32_t at = 1024 + ((char*) &sb->featureIncompat - (char*) sb);
+    sb->featureIncompat |= FEATURE_RECOVER;
+    fs->write_all(at, (char*) &sb->featureIncompat, 4);
+    fs->sync(at, 4);
+    fs->dev->flush_cache();
+
+    return journal;
+}
+
+void Journal::read(uint32_t block, char* buffer) {
+    fs->read_all(map[block] * bs, bs, buffer);
+}
+
+void Journal::write(uint32_t block, const char* buffer) {
+    fs->write_all(map[block] * bs, (char*) buffer, bs);
+}
+
+void Journal::write_super(uint32_t start, uint32_t sequence) {
+    auto js = (JournalSuper*) super;
+    js->start = be(start);
+    js->sequence = be(sequence);
+    write(0, super);
+    fs->sync(map[0] * bs, bs);
+}
+
+uint32_t Journal::pass(uint32_t which, uint32_t block, uint32_t tid, uint32_t end, BlockSet& revoked) {
+    auto buffer = new char[bs];
+    auto data = new char[bs];
+    auto h = (Header*) buffer;
+
+    while ((which == SCAN) || (tid != end)) {
+        read(block, buffer);
+        if ((be(h->magic) != MAGIC) || (be(h->sequence) != tid)) break;
+        block = next(block);
+
+        auto type = be(h->type);
+        if (type == DESCRIPTOR_BLOCK) {
+            // a tag for each of the blocks that follow
+            uint32_t offset = sizeof(Header);
+            while (offset + TAG_SIZE <= bs) {
+                auto tag = buffer + offset;
+                uint32_t home = be(*(uint32_t*) tag);
+                uint32_t flags = __builtin_bswap16(*(uint16_t*) (tag + 6));
+                if (which == REPLAY) {
+                    read(block, data);
+                    auto when = revoked.find(home);
+                    bool skip = (when != nullptr) && (int32_t(*when - tid) >= 0);
+                    if (!skip && (home < fs->superBlock->totalBlocks)) {
+                        if (flags & TAG_ESCAPE) *(uint32_t*) data = be(MAGIC);
+                        fs->write_all(home * bs, data, bs);
+                    }
+                }
+                block = next(block);
+                offset += TAG_SIZE;
+                if (!(flags & TAG_SAME_UUID)) offset += UUID_SIZE;
+                if (flags & TAG_LAST) break;
+            }
+        } else if (type == COMMIT_BLOCK) {
+            tid += 1;
+        } else if (type == REVOKE_BLOCK) {
+            if (which == REVOKES) {
+                uint32_t used = K::min(be(*(uint32_t*) (buffer + sizeof(Header))), bs);
+                for (uint32_t offset = sizeof(Header) + 4; offset + 4 <= used; offset += 4) {
+                    uint32_t revokedBlock = be(*(uint32_t*) (buffer + offset));
+                    // the latest revoke counts
+                    auto when = revoked.find(revokedBlock);
+                    if (when == nullptr) {
+                        revoked.put(revokedBlock) = tid;
+                    } else if (int32_t(tid - *when) > 0) {
+                        *when = tid;
+                    }
+                }
+            }
+        } else {
+            break;
+        }
+    }
+
+    delete[] buffer;
+    delete[] data;
+    return tid;
+}
+
+void Journal::replay() {
+    auto js = (JournalSuper*) super;
+    uint32_t start = be(js->start);
+    uint32_t tid = be(js->sequence);
+    if (start == 0) return;
+
+    // the transactions that made it to their commit block, then the
+    // revokes in them, then their blocks
+    BlockSet revoked{};
+    uint32_t end = pass(SCAN, start, tid, 0, revoked);
+    pass(REVOKES, start, tid, end, revoked);
+    pass(REPLAY, start, tid, end, revoked);
+    if (end != tid) {
+        Debug::printf("| ext2: replayed %d transactions from the journal\n", end - tid);
+    }
+
+    // it's all home, the log starts over (past anything torn in it)
+    BCache::sync(fs->dev.ptr);
+    delete running;
+    running = new Transaction(end + 1);
+    committed = end;
+    write_super(0, running->tid);
+    fs->dev->flush_cache();
+}
+
+void Journal::begin() {
+    auto me = gheith::current();
+    if (me->journalDepth > 0) {
+        me->journalDepth += 1;
+        return;
+    }
+
+    // a transaction doesn't grow past a quarter of the log
+    uint32_t n;
+    {
+        LockGuard g{lock};
+        n = running->order.n;
+    }
+    if (n >= (last - first) / 4) commit(false);
+
+    me->journalDepth = 1;
+    gate.lock();
+    handles.add_fetch(1);
+    gate.unlock();
+}
+
+void Journal::end() {
+    auto me = gheith::current();
+    ASSERT(me->journalDepth > 0);
+    me->journalDepth -= 1;
+    if (me->journalDepth > 0) return;
+
+    if ((handles.add_fetch(-1) == 0) && draining.exchange(false)) {
+        drained.up();
+    }
+}
+
+void Journal::drain() {
+    draining.set(true);
+    // the last handle ups it, or already has if draining got cleared
+    if ((handles.get() != 0) || !draining.exchange(false)) {
+        drained.down();
+    }
+}
+
+void Journal::log(uint32_t block) {
+    LockGuard g{lock};
+    auto t = running;
+    // freed and back as metadata, the new copy has to be replayed
+    t->revokes.remove(block);
+    if (t->blocks.find(block) != nullptr) return;
+    t->blocks.put(block);
+    t->order.add(block);
+    BCache::hold(fs->dev.ptr, block * bs, bs);
+}
+
+void Journal::revoke(uint32_t block) {
+    LockGuard g{lock};
+    bool inLog = (logged->find(block) != nullptr) || (running->blocks.find(block) != nullptr) ||
+        ((committing != nullptr) && (committing->blocks.find(block) != nullptr));
+    if (inLog && !running->revokes.contains(block)) {
+        running->revokes.add(block);
+    }
+}
+
+uint32_t Journal::write_log(Transaction* t) {
+    const uint32_t perDescriptor = (bs - sizeof(Header) - UUID_SIZE) / TAG_SIZE;
+    const uint32_t perRevoke = (bs - sizeof(Header) - 4) / 4;
+    uint32_t n = t->order.n;
+    uint32_t need = n + (n + perDescriptor - 1) / perDescriptor + (t->revokes.n + perRevoke - 1) / perRevoke + 1;
+    if (need > last - first) return 0;
+    if (head + need > last) {
+        // handles keep transactions small, this is what a lot of them
+        // at once looks like: make room by starting the log over
+        checkpoint(t);
+    }
+
+    if (empty) {
+        write_super(head, t->tid);
+        empty = false;
+    }
+
+    auto descriptor = new char[bs];
+    auto data = new char[bs];
+
+    uint32_t i = 0;
+    while (i < n) {
+        uint32_t at = head;
+        head += 1;
+        bzero(descriptor, bs);
+        header(descriptor, DESCRIPTOR_BLOCK, t->tid);
+        uint32_t offset = sizeof(Header);
+        for (uint32_t k = 0; (k < perDescriptor) && (i < n); k++, i++) {
+            uint32_t block = t->order.at[i];
+            fs->read_all(block * bs, bs, data);
+
+            uint32_t flags = (k == 0) ? 0 : TAG_SAME_UUID;
+            if (*(uint32_t*) data == be(MAGIC)) {
+                flags |= TAG_ESCAPE;
+                *(uint32_t*) data = 0;
+            }
+            *t->blocks.find(block) = head | ((flags & TAG_ESCAPE) ? ESCAPED : 0);
+            if ((i + 1 == n) || (k + 1 == perDescriptor)) flags |= TAG_LAST;
+
+            *(uint32_t*) (descriptor + offset) = be(block);
+            *(uint32_t*) (descriptor + offset + 4) = be(flags);
+            offset += TAG_SIZE;
+            if (k == 0) {
+                memcpy(descriptor + offset, ((JournalSuper*) super)->uuid, UUID_SIZE);
+                offset += UUID_SIZE;
+            }
+
+            write(head, data);
+            head += 1;
+        }
+        write(at, descriptor);
+    }
+
+    uint32_t r = 0;
+    while (r < t->revokes.n) {
+        bzero(descriptor, bs);
+        header(descriptor, REVOKE_BLOCK, t->tid);
+        uint32_t offset = sizeof(Header) + 4;
+        for (; (r < t->revokes.n) && (offset + 4 <= bs); r++, offset += 4) {
+            *(uint32_t*) (descriptor + offset) = be(t->revokes.at[r]);
+        }
+        *(uint32_t*) (descriptor + sizeof(Header)) = be(offset);
+        write(head, descriptor);
+        head += 1;
+    }
+
+    delete[] descriptor;
+    delete[] data;
+
+    uint32_t commitAt = head;
+    head += 1;
+    return commitAt;
+}
+
+bool Journal::commit(bool discard) {
+    ASSERT(gheith::current()->journalDepth == 0);
+
+    uint32_t want;
+    {
+        LockGuard g{lock};
+        want = running->tid;
+    }
+
+    LockGuard c{commitLock};
+    // a commit that started after our call took care of it
+    if (!discard && (int32_t(committed - want) >= 0)) return false;
+
+    // no new handles until we have a consistent transaction
+    gate.lock();
+    drain();
+    fs->write_dirty(discard);
+
+    Transaction* t;
+    {
+        LockGuard g{lock};
+        t = running;
+        if (t->empty()) {
+            gate.unlock();
+            return false;
+        }
+        running = new Transaction(t->tid + 1);
+        committing = t;
+    }
+    uint32_t at = write_log(t);
+    if (at == 0) {
+        // it stays the running transaction, in the cache, and nothing
+        // after it commits. Handles are small enough that it shouldn't
+        // happen
+        Debug::printf("| ext2: transaction %d (%d blocks) doesn't fit in the journal\n", t->tid, t->order.n);
+        {
+            LockGuard g{lock};
+            ASSERT(running->empty());
+            delete running;
+            running = t;
+            committing = nullptr;
+        }
+        gate.unlock();
+        return false;
+    }
+
+    // a log that's more than half used starts over after this one, and
+    // the next transaction can't have anything in it until then
+    bool full = (last - head) < (last - first) / 2;
+    if (!full) gate.unlock();
+
+    // ordered: the data and the log, then the commit block
+    BCache::sync(fs->dev.ptr);
+    auto block = new char[bs];
+    bzero(block, bs);
+    header(block, COMMIT_BLOCK, t->tid);
+    write(at, block);
+    delete[] block;
+    fs->sync(map[at] * bs, bs);
+    fs->dev->flush_cache();
+
+    // committed, the blocks can go home unless they changed again
+    {
+        LockGuard g{lock};
+        for (uint32_t i = 0; i < t->order.n; i++) {
+            uint32_t b = t->order.at[i];
+            logged->put(b) = *t->blocks.find(b);
+            if (running->blocks.find(b) == nullptr) BCache::release(fs->dev.ptr, b * bs, bs);
+        }
+        committing = nullptr;
+        committed = t->tid;
+    }
+    delete t;
+
+    if (full) {
+        checkpoint();
+        gate.unlock();
+    }
+    return true;
+}
+
+void Journal::checkpoint(Transaction* t) {
+    BCache::sync(fs->dev.ptr);
+
+    // what "t" changed again is held in the cache with its changes, the
+    // copy from the last commit is in the log and goes home from there
+    // before the log forgets it
+    if (t != nullptr) {
+        auto data = new char[bs];
+        auto dev = fs->dev.ptr;
+        bool wrote = false;
+        for (uint32_t i = 0; i < t->order.n; i++) {
+            uint32_t b = t->order.at[i];
+            uint32_t where;
+            {
+                LockGuard g{lock};
+                auto w = logged->find(b);
+                if (w == nullptr) continue;
+                where = *w;
+            }
+            read(where & ~ESCAPED, data);
+            if (where & ESCAPED) *(uint32_t*) data = be(MAGIC);
+            // around the cache, it has the new version
+            dev->write_blocks(b * (bs / dev->block_size), bs / dev->block_size, data);
+            wrote = true;
+        }
+        delete[] data;
+        if (wrote) dev->flush_cache();
+    }
+
+    uint32_t tid;
+    {
+        LockGuard g{lock};
+        ASSERT(running->empty());
+        tid = running->tid;
+        logged->clear();
+    }
+    write_super(0, tid);
+    fs->dev->flush_cache();
+
+    head = first;
+    empty = true;
+}
+
+void Journal::close() {
+    LockGuard c{commitLock};
+    LockGuard g{gate};
+    drain();
+    {
+        LockGuard g2{lock};
+        // something came in after the sync, the log stays
+        if (!running->empty()) return;
+    }
+    checkpoint();
+
+    auto sb = fs->superBlock;
+    uint32_t at = 1024 + ((char*) &sb->featureIncompat - (char*) sb);
+    sb->featureIncompat &= ~FEATURE_RECOVER;
+    fs->write_all(at, (char*) &sb->featureIncompat, 4);
+    fs->sync(at, 4);
+    fs->dev->flush_cache();
+}
@@ -0,0 +1,120 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "stdint.h"
+#include "ext2.h"
+#include "atomic.h"
+#include "semaphore.h"
+#include "blocking_lock.h"
+
+//
+// The journal (ext3's, in the JBD format)
+//
+// Volumes made with a journal (mke2fs -j, tune2fs -j) keep one in an
+// i-node. Metadata changes (i-nodes, bitmaps, descriptors, directories,
+// pointer blocks) go through Ext2::log_all: the block joins the running
+// transaction and its pieces are held in the buffer cache, so only
+// committed metadata ever goes home. File data isn't logged.
+//
+// A commit closes the running transaction once the handles in it are
+// done, copies its blocks to the log and then, in order:
+//
+//     the data and the log go to the disk, flush     (ordered mode)
+//     the commit block, flush
+//     the transaction's blocks are released, the flusher takes them home
+//
+// Everything that happened since the last commit goes in the next one,
+// so a burst of operations (and every fsync waiting on them) costs two
+// flushes. The flusher commits every so often, fsync and sync wait for
+// a commit.
+//
+// The log is written from the start of the journal. When it's close to
+// full everything goes home and it starts over (a checkpoint). A block
+// that changed again since its commit goes home from its copy in the
+// log, the cache has the newer version. Blocks that held logged metadata
+// and get freed are revoked so a replay can't put old metadata over what
+// they hold now.
+//
+// At mount, committed transactions still in the log are replayed.
+//
+struct BlockSet;
+struct Transaction;
+
+struct Journal {
+    // The journal of "fs" with whatever it had replayed, nullptr if we
+    // can't use it
+    static Journal* open(Ext2* fs);
+
+    // Handle does these (see ext2.h)
+    void begin();
+    void end();
+
+    // Disk block "block" is about to change, call it in a handle
+    void log(uint32_t block);
+
+    // Disk block "block" is free
+    void revoke(uint32_t block);
+
+    // Returns when everything before the call is committed. "discard"
+    // also gives back the preallocated blocks. False if it didn't have
+    // to flush the device (or couldn't commit)
+    bool commit(bool discard);
+
+    // Checkpoints and marks the volume clean, call it after a sync
+    void close();
+
+private:
+    Ext2* const fs;
+    const uint32_t bs;
+    uint32_t* map;              // journal block -> disk block
+    char* super;                // the journal superblock, as on disk
+    uint32_t first;             // the log is [first,last)
+    uint32_t last;
+    uint32_t head = 0;          // where the next transaction goes
+    bool empty = true;          // the superblock says there's no log
+
+    BlockingLock lock{};        // the transactions and the sets
+    BlockingLock gate{};        // new handles wait here while we close one
+    BlockingLock commitLock{};  // one commit at a time
+    Atomic<uint32_t> handles{0};
+    Atomic<bool> draining{false};
+    Semaphore drained{0};
+
+    Transaction* running;
+    Transaction* committing = nullptr;
+    uint32_t committed;         // the last durable transaction
+    BlockSet* logged;           // blocks in the log since the last checkpoint, where they are
+
+    Journal(Ext2* fs, uint32_t* map, char* super);
+
+    uint32_t next(uint32_t block) {
+        return (block + 1 == last) ? first : block + 1;
+    }
+
+    void read(uint32_t block, char* buffer);
+    void write(uint32_t block, const char* buffer);
+
+    // Writes the superblock with the log starting at "start" (0 for no
+    // log) with transaction "sequence"
+    void write_super(uint32_t start, uint32_t sequence);
+
+    // One pass over the log from "block", returns the transaction it
+    // ended on
+    uint32_t pass(uint32_t which, uint32_t block, uint32_t tid, uint32_t end, BlockSet& revoked);
+    void replay();
+
+    // Waits for the open handles, call with the gate held
+    void drain();
+
+    // Writes "t" to the log in the cache, returns where its commit
+    // block goes (0 if "t" is bigger than the log). Call with the gate
+    // held, it checkpoints if "t" doesn't fit in what's left of the log
+    uint32_t write_log(Transaction* t);
+
+    // Everything goes home and the log starts over, call with the gate
+    // held and nothing in the running transaction. "t" is the one being
+    // committed if it has blocks held in the cache
+    void checkpoint(Transaction* t = nullptr);
+};
+
+#endif
@@ -3,9 +3,48 @@
 #include "ide.h"
 #include "threads.h"
 #include "network.h"
+#include "swap.h"
+#include "mount.h"
+#include "ramdisk.h"
 
 using namespace gheith;
 
+// The root file system and swap live on these, the other drives get
+// probed for ext2 volumes
+constexpr static uint32_t ROOT_DRIVE = 1;
+constexpr static uint32_t SWAP_DRIVE = 2;
+
+// "name" in "dir", made if it's not there
+static Shared<Node> subdirectory(Shared<Node> dir, const char* name) {
+    auto out = dir->fileSystem->find(dir, name);
+    if (out == nullptr) {
+        dir->fileSystem->createNode(dir, name, ENTRY_DIRECTORY_TYPE);
+        out = dir->fileSystem->find(dir, name);
+    }
+    return out;
+}
+
+// Every other drive with an ext2 volume on it shows up as /mnt/hd[a-d].
+// Each controller has its own queue and I/O thread so volumes on
+// different controllers move data at the same time
+static void mountOthers(Shared<Ext2> fs) {
+    for (uint32_t drive = 0; drive < 4; drive++) {
+        if ((drive == ROOT_DRIVE) || (drive == SWAP_DRIVE)) continue;
+        auto dev = Shared<Ide>::make(drive);
+        if (!Ext2::probe(dev.ptr)) continue;
+
+        char name[] = "hda";
+        name[2] = 'a' + drive;
+        auto on = subdirectory(subdirectory(fs->root, "mnt"), name);
+        if ((on == nullptr) || !on->is_dir()) {
+            Debug::printf("| can't mount drive %d on /mnt/%s\n", drive, name);
+            continue;
+        }
+        Mounts::mount(on, Shared<Ext2>::make(dev));
+        Debug::printf("| drive %d mounted on /mnt/%s\n", drive, name);
+    }
+}
+
 void kernelMain(void) {
     // Create shell
     Shell shell{false};
@@ -14,8 +53,19 @@ void kernelMain(void) {
     Debug::init(&shell);
 
     // Mount file system
-    Shared<Ide> ide = Shared<Ide>::make(1);
+    Shared<Ide> ide = Shared<Ide>::make(ROOT_DRIVE);
+#if RAMDISK
+    Shared<Ext2> fs = Shared<Ext2>::make(RamDisk::copy_of(ide.ptr));
+    Debug::printf("| running from a copy of drive %d in memory\n", ROOT_DRIVE);
+#else
     Shared<Ext2> fs = Shared<Ext2>::make(ide);
+#endif
+    Mounts::mount(Shared<Node>{}, fs);
+
+    // User pages go to the next drive when we run out of memory
+    Swap::init(Shared<Ide>::make(SWAP_DRIVE));
+
+    mountOthers(fs);
 
     TCB *me = current();
     me->fs = fs;
@@ -26,10 +76,16 @@ void kernelMain(void) {
 
     me->shell = &shell;
 
+    // a volume can bring commands to run at boot (the tests do)
+    shell.run("/etc/rc");
+
     // Init network driver
     // Network network{};
 
     // Start shell
     shell.start();
+
+    // the kernel shuts down when we return, the volumes go with it
+    Mounts::unmount();
 }
 
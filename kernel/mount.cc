@@ -0,0 +1,103 @@
+#include "mount.h"
+#include "blocking_lock.h"
+#include "debug.h"
+#include "pit.h"
+#include "threads.h"
+
+namespace Mounts {
+
+    constexpr static uint32_t ROOT_INODE = 2;
+
+    struct Mount {
+        Shared<Node> on;        // nullptr for the root file system
+        Shared<Ext2> fs;
+    };
+
+    static Mount table[MAX_MOUNTS];
+    static uint32_t nMounts = 0;
+    static BlockingLock lock{};
+
+    // copies the volumes so they can be used without the lock
+    static uint32_t snapshot(Shared<Ext2>* all) {
+        LockGuard g{lock};
+        for (uint32_t i = 0; i < nMounts; i++) all[i] = table[i].fs;
+        return nMounts;
+    }
+
+    // The i-nodes and allocation bitmaps stay dirty in memory. Every
+    // FLUSH_INTERVAL the flusher calls write_back on each volume: with a
+    // journal that commits them (and whatever else changed), without one
+    // it moves them to the buffer cache. Either way BCache's own flusher
+    // takes them home
+    constexpr static uint32_t FLUSH_INTERVAL = 500;
+    static Atomic<bool> flusherStarted{false};
+
+    static void start_flusher() {
+        if (flusherStarted.exchange(true)) return;
+        thread([] {
+            while (true) {
+                Pit::sleep(FLUSH_INTERVAL);
+                Shared<Ext2> all[MAX_MOUNTS];
+                auto n = snapshot(all);
+                for (uint32_t i = 0; i < n; i++) all[i]->write_back(false);
+            }
+        });
+    }
+
+    static bool same(Node* a, Node* b) {
+        return (a->fileSystem == b->fileSystem) && (a->number == b->number);
+    }
+
+    void mount(Shared<Node> on, Shared<Ext2> fs) {
+        if ((on != nullptr) && !on->is_dir()) {
+            Debug::panic("can only mount on a directory, %d isn't one\n",on->number);
+        }
+
+        LockGuard g{lock};
+        if (nMounts == MAX_MOUNTS) {
+            Debug::panic("mount table is full\n");
+        }
+        table[nMounts].on = on;
+        table[nMounts].fs = fs;
+        nMounts += 1;
+        start_flusher();
+    }
+
+    Shared<Node> cross(Shared<Node> dir) {
+        if ((dir == nullptr) || !dir->is_dir()) return dir;
+
+        LockGuard g{lock};
+        for (uint32_t i = 0; i < nMounts; i++) {
+            auto& m = table[i];
+            if ((m.on != nullptr) && same(m.on.ptr,dir.ptr)) return m.fs->root;
+        }
+        return dir;
+    }
+
+    Shared<Node> covered(Node* root) {
+        if (root->number != ROOT_INODE) return Shared<Node>{};
+
+        LockGuard g{lock};
+        for (uint32_t i = 0; i < nMounts; i++) {
+            auto& m = table[i];
+            if (m.fs.ptr == root->fileSystem) return m.on;
+        }
+        return Shared<Node>{};
+    }
+
+    void sync() {
+        Shared<Ext2> all[MAX_MOUNTS];
+        auto n = snapshot(all);
+        for (uint32_t i = 0; i < n; i++) {
+            all[i]->sync();
+        }
+    }
+
+    void unmount() {
+        Shared<Ext2> all[MAX_MOUNTS];
+        auto n = snapshot(all);
+        for (uint32_t i = 0; i < n; i++) {
+            all[i]->unmount();
+        }
+    }
+}
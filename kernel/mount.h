@@ -0,0 +1,41 @@
+#ifndef _MOUNT_H_
+#define _MOUNT_H_
+
+#include "stdint.h"
+#include "shared.h"
+#include "ext2.h"
+
+//
+// The mount table
+//
+// There is one path namespace. The root file system provides "/" and
+// other volumes are grafted on directories of the ones already there.
+// Ext2::find crosses into a volume when it reaches the directory it is
+// mounted on, and back out on ".." from the volume's root.
+//
+//     Mounts::mount(Shared<Node>{},rootFs);       // "/"
+//     Mounts::mount(rootFs->find(rootFs->root,"mnt/hdd"),otherFs);
+//
+namespace Mounts {
+
+    constexpr uint32_t MAX_MOUNTS = 8;
+
+    // Mounts "fs" on the directory "on", nullptr for the root file system
+    void mount(Shared<Node> on, Shared<Ext2> fs);
+
+    // The root of the volume mounted on "dir", "dir" itself if there is none
+    Shared<Node> cross(Shared<Node> dir);
+
+    // The directory a volume's root is mounted on, nullptr if "root" isn't
+    // the root of a mounted volume (or it's the root of the namespace)
+    Shared<Node> covered(Node* root);
+
+    // Syncs every mounted volume
+    void sync();
+
+    // Syncs every mounted volume and leaves it clean, the system is
+    // going down
+    void unmount();
+}
+
+#endif
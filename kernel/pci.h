@@ -49,7 +49,7 @@ struct pci_cfg {
     uint8_t current_state;
 };
 
-uint32_t pci_read_config_dword(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg) {
+inline uint32_t pci_read_config_dword(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg) {
     uint16_t base;
 
     union {
@@ -70,7 +70,7 @@ uint32_t pci_read_config_dword(uint32_t bus, uint32_t dev, uint32_t func, uint32
     return inl(base);
 }
 
-void pci_write_config_dword(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, uint32_t val) {
+inline void pci_write_config_dword(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, uint32_t val) {
     uint16_t base;
 
     union {
@@ -91,13 +91,13 @@ void pci_write_config_dword(uint32_t bus, uint32_t dev, uint32_t func, uint32_t
     outl(base, val);
 }
 
-uint32_t pci_size(uint32_t base, unsigned long mask) {
+inline uint32_t pci_size(uint32_t base, unsigned long mask) {
     uint32_t size = mask & base;
     size = size & ~(size-1);
     return(size-1);
 }
 
-void pci_read_bases(pci_cfg *cfg, uint32_t bases) {
+inline void pci_read_bases(pci_cfg *cfg, uint32_t bases) {
     uint32_t l, sz, reg;
     uint32_t i;
 
@@ -134,7 +134,7 @@ void pci_read_bases(pci_cfg *cfg, uint32_t bases) {
     }
 }
 
-pci_cfg *find_network_card()
+inline pci_cfg *find_network_card()
 {
     // Read 4 bytes at a time
     pci_cfg *cfg = new pci_cfg;
@@ -161,4 +161,22 @@ pci_cfg *find_network_card()
     return nullptr;
 }
 
+// Finds the first function with the given class and subclass, returns
+// false if there is none
+inline bool pci_find_class(uint8_t base_class, uint8_t sub_class, uint32_t& bus, uint32_t& dev, uint32_t& func) {
+    for (bus = 0; bus < 4; bus++) {
+        for (dev = 0; dev < 32; dev++) {
+            for (func = 0; func < 8; func++) {
+                auto id = pci_read_config_dword(bus, dev, func, 0);
+                if ((id & 0xFFFF) == 0xFFFF) continue;
+                auto cls = pci_read_config_dword(bus, dev, func, 0x08);
+                if (((cls >> 24) == base_class) && (((cls >> 16) & 0xFF) == sub_class)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
 #endif
\ No newline at end of file
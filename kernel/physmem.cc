@@ -4,6 +4,10 @@
 #include "debug.h"
 #include "atomic.h"
 #include "idt.h"
+#include "threads.h"
+#include "semaphore.h"
+#include "libk.h"
+#include "vmm.h"
 
 namespace PhysMem {
 
@@ -13,11 +17,41 @@ namespace PhysMem {
         Frame* next;
     };
 
+    constexpr static uint32_t NO_FRAME = uint32_t(-1);
+
+    // how many frames we ask the shrinkers for when an allocation fails
+    constexpr static uint32_t RECLAIM_BATCH = 32;
+    constexpr static uint32_t RECLAIM_TRIES = 4;
+
     static Frame* firstFree = nullptr;
     static uint32_t avail;
     static uint32_t limit;
+    static uint32_t nFree = 0;
+    static uint32_t low = 0;
+    static uint32_t high = 0;
 
-    uint32_t alloc_frame(bool panicIfOut) {
+    static Shrinker* firstShrinker = nullptr;
+    static Shrinker* lastShrinker = nullptr;
+
+    // High memory, one bit per frame (1 -> in use). The bitmaps live
+    // in low memory.
+    struct HighRange {
+        uint64_t start;
+        uint32_t nFrames;
+        uint32_t* used;
+        uint32_t hint;
+    };
+
+    constexpr static uint32_t MAX_HIGH_RANGES = 2;
+    static HighRange highRanges[MAX_HIGH_RANGES];
+    static uint32_t nHighRanges = 0;
+    static uint32_t nHighFree = 0;
+    static InterruptSafeLock highLock{};
+
+    static Semaphore* kick = nullptr;
+    static Atomic<bool> kicked{false};
+
+    static uint32_t take_frame() {
         LockGuard g{lock};
 
         uint32_t p;
@@ -26,14 +60,44 @@ namespace PhysMem {
             p = (uint32_t) firstFree;
             firstFree = firstFree->next;
         } else {
-            if (avail == limit) {
-                if (panicIfOut) Debug::panic("no more frames");
-                else return -1;
-            }
+            if (avail == limit) return NO_FRAME;
             p = avail;
             avail += FRAME_SIZE;
         }
 
+        nFree -= 1;
+        return p;
+    }
+
+    // Shrinkers are allowed to block (I/O, locks, ...) so we can only
+    // call them from a real thread that has interrupts enabled
+    static bool can_block() {
+        if (Interrupts::isDisabled()) return false;
+        if (gheith::activeThreads == nullptr) return false;
+        return !gheith::current()->isIdle;
+    }
+
+    static void wake_reclaimer() {
+        if (kick == nullptr) return;
+        if (kicked.exchange(true)) return;
+        kick->up();
+    }
+
+    uint32_t alloc_frame(bool panicIfOut) {
+        uint32_t p = take_frame();
+
+        for (uint32_t i = 0; (p == NO_FRAME) && (i < RECLAIM_TRIES) && can_block(); i++) {
+            reclaim(RECLAIM_BATCH);
+            p = take_frame();
+        }
+
+        if (p == NO_FRAME) {
+            if (panicIfOut) Debug::panic("no more frames");
+            return -1;
+        }
+
+        if (nFree < low) wake_reclaimer();
+
         ASSERT(offset(p) == 0);
 
         bzero((void*)p,FRAME_SIZE);
@@ -49,8 +113,159 @@ namespace PhysMem {
         Frame* f = (Frame*) p;    
         f->next = firstFree;
         firstFree = f;
+        nFree += 1;
+    }
+
+    static paddr_t take_high() {
+        LockGuard g{highLock};
+
+        if (nHighFree == 0) return paddr_t(-1);
+
+        for (uint32_t r = 0; r < nHighRanges; r++) {
+            auto& range = highRanges[r];
+            auto nWords = (range.nFrames + 31) / 32;
+            for (uint32_t i = 0; i < nWords; i++) {
+                auto w = (range.hint + i) % nWords;
+                auto bits = range.used[w];
+                if (bits == 0xFFFFFFFF) continue;
+                auto bit = __builtin_ctz(~bits);
+                auto frame = w * 32 + bit;
+                if (frame >= range.nFrames) continue;
+                range.used[w] = bits | (1 << bit);
+                range.hint = w;
+                nHighFree -= 1;
+                return range.start + uint64_t(frame) * FRAME_SIZE;
+            }
+        }
+
+        return paddr_t(-1);
+    }
+
+    paddr_t alloc_user_frame(bool panicIfOut) {
+        for (uint32_t i = 0; true; i++) {
+            auto hp = take_high();
+            if (hp != paddr_t(-1)) {
+                VMM::KMap m{hp};
+                bzero(m.ptr(),FRAME_SIZE);
+                return hp;
+            }
+
+            auto p = take_frame();
+            if (p != NO_FRAME) {
+                if (nFree < low) wake_reclaimer();
+                bzero((void*)p,FRAME_SIZE);
+                return p;
+            }
+
+            if ((i == RECLAIM_TRIES) || !can_block()) break;
+            reclaim(RECLAIM_BATCH);
+        }
+
+        if (panicIfOut) Debug::panic("no more frames");
+        return paddr_t(-1);
+    }
+
+    void dealloc_user_frame(paddr_t pa) {
+        if (pa < limit) {
+            dealloc_frame(uint32_t(pa));
+            return;
+        }
+
+        LockGuard g{highLock};
+
+        for (uint32_t r = 0; r < nHighRanges; r++) {
+            auto& range = highRanges[r];
+            if ((pa < range.start) || (pa >= range.start + uint64_t(range.nFrames) * FRAME_SIZE)) continue;
+            uint32_t frame = (pa - range.start) / FRAME_SIZE;
+            ASSERT((range.used[frame / 32] >> (frame % 32)) & 1);
+            range.used[frame / 32] &= ~(1 << (frame % 32));
+            nHighFree += 1;
+            return;
+        }
+
+        Debug::panic("dealloc of unknown frame 0x%x\n",uint32_t(pa));
     }
 
+    uint32_t free_high_frames() {
+        return nHighFree;
+    }
+
+    uint32_t free_frames() {
+        return nFree;
+    }
+
+    uint32_t low_watermark() {
+        return low;
+    }
+
+    uint32_t high_watermark() {
+        return high;
+    }
+
+    void register_shrinker(Shrinker* shrinker) {
+        LockGuard g{lock};
+
+        // only ever appended to, reclaim() walks it without the lock
+        shrinker->next = nullptr;
+        if (lastShrinker == nullptr) {
+            firstShrinker = shrinker;
+        } else {
+            lastShrinker->next = shrinker;
+        }
+        lastShrinker = shrinker;
+    }
+
+    uint32_t reclaim(uint32_t wanted) {
+        uint32_t freed = 0;
+        for (auto s = firstShrinker; (s != nullptr) && (freed < wanted); s = s->next) {
+            freed += s->shrink(wanted - freed);
+        }
+        return freed;
+    }
+
+    void start_reclaimer() {
+        kick = new Semaphore(0);
+
+        // kswapd: sleeps until we drop below the low watermark then
+        // shrinks the caches back up to the high watermark
+        thread([] {
+            while (true) {
+                kick->down();
+                kicked.set(false);
+                while (nFree < high) {
+                    if (reclaim(high - nFree) == 0) break;
+                }
+            }
+        });
+    }
+
+    void init_high(uint64_t start, uint64_t size) {
+        if (size < FRAME_SIZE) return;
+        ASSERT(nHighRanges < MAX_HIGH_RANGES);
+
+        auto nFrames = uint32_t(size / FRAME_SIZE);
+        auto nWords = (nFrames + 31) / 32;
+        auto bitmapFrames = (nWords * sizeof(uint32_t) + FRAME_SIZE - 1) / FRAME_SIZE;
+
+        // The bitmap has to be contiguous, carve it out of the low pool
+        // before anybody else gets to it
+        LockGuard g{lock};
+        ASSERT(firstFree == nullptr);
+        ASSERT(avail + bitmapFrames * FRAME_SIZE <= limit);
+        auto used = (uint32_t*) avail;
+        avail += bitmapFrames * FRAME_SIZE;
+        nFree -= bitmapFrames;
+        bzero(used,nWords * sizeof(uint32_t));
+
+        auto& range = highRanges[nHighRanges++];
+        range.start = start;
+        range.nFrames = nFrames;
+        range.used = used;
+        range.hint = 0;
+        nHighFree += nFrames;
+
+        Debug::printf("| high memory at %dMB, %dMB\n",uint32_t(start >> 20),uint32_t(size >> 20));
+    }
 
     void init(uint32_t start, uint32_t size) {
         ASSERT(offset(start) == 0);
@@ -58,10 +273,16 @@ namespace PhysMem {
         Debug::printf("| physical range 0x%x 0x%x\n",start,start+size);
         avail = start;
         limit = start + size;
+        nFree = size / FRAME_SIZE;
+
+        // keep ~1.5% of memory free, more is a waste, less makes
+        // the page fault path do all the reclaiming
+        low = K::min(K::max(nFree / 64, 16u), nFree);
+        high = K::min(2 * low, nFree);
+        Debug::printf("| frame watermarks low %d high %d\n",low,high);
 
         /* register the page fault handler */
         IDT::trap(14,(uint32_t)pageFaultHandler_,3);
     }
     
 };
-
@@ -6,8 +6,24 @@
 namespace PhysMem {
     constexpr uint32_t FRAME_SIZE = 1 << 12;
 
+#if PAE
+    typedef uint64_t paddr_t;
+#else
+    typedef uint32_t paddr_t;
+#endif
+
+    // Low memory is identity mapped in every address space, it has to
+    // stay below the kmap window (see VMM::KMap)
+    constexpr uint32_t LOW_LIMIT = 0x7FC00000;
+
+    // The identity mapped frames, used for kernel data structures
     void init(uint32_t start, uint32_t size);
 
+    // Adds a range of high memory frames. Those are not mapped anywhere,
+    // they are only handed out for user pages and the kernel needs to
+    // kmap them to touch them
+    void init_high(uint64_t start, uint64_t size);
+
     inline uint32_t offset(uint32_t pa) {
         return pa & 0xFFF;
     }
@@ -24,9 +40,75 @@ namespace PhysMem {
         return framedown(pa + FRAME_SIZE - 1);
     }
 
+    // Tries to reclaim frames (synchronously) before giving up
     uint32_t alloc_frame(bool panicIfOut);
 
     void dealloc_frame(uint32_t);
+
+    // Frame for a user page, comes from high memory if there is any left.
+    // Returns -1 when out of memory (unless panicIfOut)
+    paddr_t alloc_user_frame(bool panicIfOut);
+
+    // Works for low and high frames
+    void dealloc_user_frame(paddr_t);
+
+    // How many high memory frames are left
+    uint32_t free_high_frames();
+
+    // How many frames can be handed out without reclaiming anything
+    uint32_t free_frames();
+
+    // Below this many free frames the reclaimer thread wakes up and
+    // shrinks the caches until we're back above the high watermark
+    uint32_t low_watermark();
+    uint32_t high_watermark();
+
+    //
+    // Caches (buffers, inodes, ...) are allowed to grab as many frames as
+    // they want as long as they register a shrinker that gives them back
+    // when we run low.
+    //
+    //    - shrink(wanted) should release up to "wanted" frames (using
+    //      dealloc_frame) and return how many it actually released
+    //    - it can block but must not allocate frames
+    //
+    class Shrinker {
+    public:
+        Shrinker* next = nullptr;
+
+        virtual ~Shrinker() {}
+        virtual uint32_t shrink(uint32_t wanted) = 0;
+    };
+
+    template <typename Work>
+    struct ShrinkerImpl : public Shrinker {
+        Work work;
+
+        ShrinkerImpl(Work work) : work(work) {}
+
+        uint32_t shrink(uint32_t wanted) override {
+            return work(wanted);
+        }
+    };
+
+    void register_shrinker(Shrinker* shrinker);
+
+    //
+    //   PhysMem::shrinker([](uint32_t wanted) -> uint32_t {
+    //       // give back up to "wanted" frames
+    //   });
+    //
+    template <typename Work>
+    void shrinker(Work work) {
+        register_shrinker(new ShrinkerImpl<Work>(work));
+    }
+
+    // Asks the registered shrinkers for up to "wanted" frames,
+    // returns how many were freed
+    uint32_t reclaim(uint32_t wanted);
+
+    // Starts the background reclaimer, needs the thread module
+    void start_reclaimer();
 }
 
 #endif
@@ -135,11 +135,53 @@ void Pit::init() {
     SMP::apit_initial_count.set(apitCounter);
 }
 
+// Sleeping threads, sorted by wake up time. Core 0 wakes them up when
+// it advances the clock
+struct Sleeper {
+    uint32_t wake;
+    gheith::TCB* tcb;
+    Sleeper* next;
+};
+
+static Sleeper* sleepers = nullptr;
+static ISL sleepLock{};
+
+void Pit::sleep(uint32_t j) {
+    using namespace gheith;
+
+    Sleeper s;
+    s.wake = jiffies + j;
+
+    auto was = sleepLock.lock();
+
+    block(BlockOption::MustBlock,[&s](TCB* me) {
+        s.tcb = me;
+        auto pp = &sleepers;
+        while ((*pp != nullptr) && (int32_t((*pp)->wake - s.wake) <= 0)) pp = &(*pp)->next;
+        s.next = *pp;
+        *pp = &s;
+        sleepLock.unlock(true); // block wants interrupts to stay disabled
+    });
+
+    if (was) cli(); else sti();
+}
+
+static void wakeSleepers() {
+    auto was = sleepLock.lock();
+    while ((sleepers != nullptr) && (int32_t(Pit::jiffies - sleepers->wake) >= 0)) {
+        auto s = sleepers;
+        sleepers = s->next;
+        gheith::schedule(s->tcb);
+    }
+    sleepLock.unlock(was);
+}
+
 extern "C" void apitHandler(uint32_t* things) {
     // interrupts are disabled.
     auto id = SMP::me();
     if (id == 0) {
         Pit::jiffies ++;
+        wakeSleepers();
     }
     SMP::eoi_reg.set(0);
     auto me = gheith::activeThreads[id];
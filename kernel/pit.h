@@ -23,6 +23,9 @@ public:
         return 0;
     }
 
+    // Blocks the calling thread for (at least) the given number of jiffies
+    static void sleep(uint32_t jiffies);
+
 };
 
 #endif
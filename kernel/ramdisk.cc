@@ -0,0 +1,90 @@
+#include "ramdisk.h"
+#include "vmm.h"
+#include "bcache.h"
+#include "machine.h"
+#include "libk.h"
+#include "debug.h"
+
+RamDisk::RamDisk(uint32_t bytes) :
+    BlockIO(sector_size),
+    bytes((bytes + sector_size - 1) / sector_size * sector_size),
+    nFrames((bytes + PhysMem::FRAME_SIZE - 1) / PhysMem::FRAME_SIZE),
+    frames(new PhysMem::paddr_t[nFrames]),
+    io("ram")
+{
+    for (uint32_t i = 0; i < nFrames; i++) {
+        frames[i] = PhysMem::alloc_user_frame(true);
+        VMM::KMap m{frames[i]};
+        bzero(m.ptr(), PhysMem::FRAME_SIZE);
+    }
+}
+
+RamDisk::~RamDisk() {
+    for (uint32_t i = 0; i < nFrames; i++) {
+        PhysMem::dealloc_user_frame(frames[i]);
+    }
+    delete[] frames;
+}
+
+void RamDisk::copy(uint32_t offset, uint32_t n, char* buffer, bool write) {
+    if ((offset > bytes) || (n > bytes - offset)) {
+        Debug::panic("ram disk has %u bytes, asked for %u..%u\n", bytes, offset, offset + n - 1);
+    }
+
+    auto total = n;
+    auto begin = rdtsc();
+    while (n > 0) {
+        auto start = offset % PhysMem::FRAME_SIZE;
+        auto count = K::min(n, PhysMem::FRAME_SIZE - start);
+        {
+            VMM::KMap m{frames[offset / PhysMem::FRAME_SIZE]};
+            auto data = (char*) m.ptr() + start;
+            if (write) {
+                memcpy(data, buffer, count);
+            } else {
+                memcpy(buffer, data, count);
+            }
+        }
+        offset += count;
+        buffer += count;
+        n -= count;
+    }
+    auto cycles = rdtsc() - begin;
+    io.submitted();
+    io.command(write, total, false, cycles);
+    io.completed(cycles);
+}
+
+void RamDisk::read_part(uint32_t block_number, uint32_t offset, uint32_t n, char* buffer) {
+    BCache::read(this, block_number * sector_size + offset, n, buffer);
+}
+
+int64_t RamDisk::read(uint32_t offset, uint32_t n, char* buffer) {
+    if (offset > bytes) return -1;
+    n = K::min(n, bytes - offset);
+    BCache::read(this, offset, n, buffer);
+    return n;
+}
+
+Shared<RamDisk> RamDisk::from_image(const char* image, uint32_t n) {
+    auto rd = Shared<RamDisk>::make(n);
+    rd->copy(0, n, (char*) image, true);
+    return rd;
+}
+
+Shared<RamDisk> RamDisk::copy_of(BlockIO* dev) {
+    // a chunk at a time through the cache, which has the newest data.
+    // Blocks it doesn't have go from the device to "chunk" directly
+    constexpr uint32_t CHUNK = 64 * 1024;
+    auto rd = Shared<RamDisk>::make(dev->size_in_bytes());
+    auto chunk = new char[CHUNK];
+    auto per = CHUNK / dev->block_size;
+    auto total = dev->size_in_bytes() / dev->block_size;
+    for (uint32_t first = 0; first < total; first += per) {
+        auto count = K::min(per, total - first);
+        BCache::read(dev, first * dev->block_size, count * dev->block_size, chunk);
+        rd->copy(first * dev->block_size, count * dev->block_size, chunk, true);
+    }
+    delete[] chunk;
+    return rd;
+}
@@ -0,0 +1,78 @@
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include "stdint.h"
+#include "block_io.h"
+#include "shared.h"
+#include "physmem.h"
+#include "iostat.h"
+
+//
+// A disk in memory
+//
+// The data lives in frames from PhysMem (high memory when there is some,
+// we kmap them to get at it). It's a block device like any other so
+// Ext2 mounts it the same way:
+//
+//     auto rd = RamDisk::copy_of(ide.ptr);
+//     auto fs = Shared<Ext2>::make(rd);
+//
+// Nothing survives a reboot. Buffers passed in have to be kernel memory,
+// the copies run with a frame kmapped.
+//
+class RamDisk : public BlockIO {
+    constexpr static uint32_t sector_size = 512;
+
+    const uint32_t bytes;
+    const uint32_t nFrames;
+    PhysMem::paddr_t* frames;
+    IoStats io;
+
+    // copies between [offset,offset+n) of the disk and "buffer"
+    void copy(uint32_t offset, uint32_t n, char* buffer, bool write);
+
+public:
+    // "bytes" (rounded up to sectors) of zeros
+    RamDisk(uint32_t bytes);
+
+    RamDisk(const RamDisk&) = delete;
+
+    virtual ~RamDisk();
+
+    // A disk that starts as a copy of "image" (embedded in the kernel)
+    static Shared<RamDisk> from_image(const char* image, uint32_t n);
+
+    // A disk that starts as a copy of everything on "dev"
+    static Shared<RamDisk> copy_of(BlockIO* dev);
+
+    IoStats* stats() override {
+        return &io;
+    }
+
+    uint32_t size_in_bytes() override {
+        return bytes;
+    }
+
+    void read_block(uint32_t block_number, char* buffer) override {
+        read_blocks(block_number, 1, buffer);
+    }
+
+    void write_block(uint32_t block_number, const char* buffer) override {
+        write_blocks(block_number, 1, buffer);
+    }
+
+    void read_blocks(uint32_t first, uint32_t count, char* buffer) override {
+        copy(first * sector_size, count * sector_size, buffer, false);
+    }
+
+    void write_blocks(uint32_t first, uint32_t count, const char* buffer) override {
+        copy(first * sector_size, count * sector_size, (char*) buffer, true);
+    }
+
+    // Reads go through the buffer cache like they do for any other
+    // device, a mounted volume's latest writes are there
+    void read_part(uint32_t block_number, uint32_t offset, uint32_t n, char* buffer) override;
+    int64_t read(uint32_t offset, uint32_t n, char* buffer) override;
+};
+
+#endif
@@ -45,6 +45,14 @@ public:
         add();
     }
 
+    //
+    // Shared<Base> e = d;  (Derived -> Base)
+    //
+    template <typename U>
+    Shared(const Shared<U>& rhs): ptr(rhs.ptr) {
+        add();
+    }
+
     //
     // Shared<Thing> d = g();
     //
@@ -5,6 +5,11 @@
 #include "atomic.h"
 #include "libk.h"
 #include "blocking_lock.h"
+#include "threads.h"
+#include "ext2.h"
+#include "u8250.h"
+
+static U8250 serial{};
 
 Shell::Shell(bool primitive) {
     if (primitive) {
@@ -81,6 +86,43 @@ void Shell::printf(const char* fmt, ...) {
     va_end(ap);
 }
 
+void Shell::put(char c) {
+    serial.put(c);
+    handle_normal(c);
+}
+
+void Shell::run(const char* path) {
+    auto me = gheith::current();
+    auto script = me->fs->find(me->fs->root, path);
+    if ((script == nullptr) || !script->is_file()) return;
+
+    uint32_t size = script->size_in_bytes();
+    auto text = new char[size];
+    script->read_all(0, size, text);
+
+    uint32_t start = 0;
+    for (uint32_t i = 0; i <= size; i++) {
+        if ((i < size) && (text[i] != '\n')) continue;
+        if (i > start) {
+            // execute looks one past the name of a program without
+            // arguments, the extra 0 is for that
+            uint32_t n = i - start;
+            char* cmd = new char[n + 2];
+            memcpy(cmd, text + start, n);
+            cmd[n] = 0;
+            cmd[n + 1] = 0;
+            // as if somebody typed it
+            print_prefix();
+            printf("%s\n", cmd);
+            cmd_runner->execute(cmd);
+            delete[] cmd;
+        }
+        start = i + 1;
+    }
+    delete[] text;
+    refresh();
+}
+
 void Shell::print_prefix() {
     LockGuardP g{the_lock};
     auto me = gheith::current();
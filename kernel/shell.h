@@ -36,6 +36,12 @@ class Shell {
         void refresh();
         void vprintf(const char* fmt, va_list ap);
         void printf(const char* fmt, ...);
+        // output goes on the screen and out the serial port (where the
+        // tests look for it)
+        void put(char c);
+        // runs the commands in a file, one per line, if the root volume
+        // has it
+        void run(const char* path);
         void println(const char *str);
         void print_prefix();
         void clear();
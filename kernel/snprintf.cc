@@ -664,7 +664,7 @@ static void fmtfp (Shell& shell, long *currlen, long maxlen,
 static void dopr_outch (Shell& shell, long *currlen, long maxlen, char c)
 {
   (*currlen) += 1;
-  shell.handle_normal(c);
+  shell.put(c);
 }
 
 void K::vsnprintf (Shell& shell, long maxlen, const char *fmt, va_list args)
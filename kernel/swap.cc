@@ -0,0 +1,273 @@
+#include "swap.h"
+#include "ide.h"
+#include "physmem.h"
+#include "blocking_lock.h"
+#include "threads.h"
+#include "config.h"
+#include "debug.h"
+#include "libk.h"
+
+namespace Swap {
+
+    using namespace gheith;
+
+    constexpr static uint32_t SECTOR_SIZE = 512;
+    constexpr static uint32_t SECTORS_PER_SLOT = PhysMem::FRAME_SIZE / SECTOR_SIZE;
+    constexpr static uint32_t NO_SLOT = 0;    // slot 0 holds the header
+
+    // The first page of a Linux swap area
+    struct Header {
+        char bootbits[1024];
+        uint32_t version;
+        uint32_t last_page;
+        uint32_t nr_badpages;
+        uint8_t uuid[16];
+        char volume_name[16];
+        uint32_t padding[117];
+        uint32_t badpages[1];
+    } __attribute__((packed));
+
+    static Shared<Ide> device{};
+    static uint32_t nSlots = 0;
+    static uint32_t* used = nullptr;       // one bit per slot
+    static uint32_t nextSlot = 1;
+    static InterruptSafeLock slotLock{};
+
+    // Serializes page-ins and page-outs (they do I/O)
+    static BlockingLock lock{};
+
+    // User pages could be in high memory, all I/O goes through this
+    // low frame (protected by the lock above)
+    static char* bounce = nullptr;
+
+    // The clock hand, it's done with an address space when it gets to
+    // VA_END (past the last page, hence 64 bits)
+    constexpr static uint64_t VA_END = uint64_t(1) << 32;
+    static uint32_t* handPd = nullptr;
+    static uint64_t handVa = USER_START;
+
+    static uint32_t nIn = 0;
+    static uint32_t nOut = 0;
+
+    static bool is_used(uint32_t slot) {
+        return (used[slot / 32] >> (slot % 32)) & 1;
+    }
+
+    static void mark(uint32_t slot, bool v) {
+        if (v) {
+            used[slot / 32] |= (1 << (slot % 32));
+        } else {
+            used[slot / 32] &= ~(1 << (slot % 32));
+        }
+    }
+
+    static uint32_t alloc_slot() {
+        LockGuard g{slotLock};
+        for (uint32_t i = 0; i < nSlots; i++) {
+            auto slot = nextSlot;
+            nextSlot = (nextSlot + 1 < nSlots) ? nextSlot + 1 : 1;
+            if (!is_used(slot)) {
+                mark(slot,true);
+                return slot;
+            }
+        }
+        return NO_SLOT;
+    }
+
+    static void free_slot(uint32_t slot) {
+        LockGuard g{slotLock};
+        ASSERT((slot != NO_SLOT) && (slot < nSlots));
+        ASSERT(is_used(slot));
+        mark(slot,false);
+    }
+
+    static void write_slot(uint32_t slot, paddr_t pa) {
+        {
+            VMM::KMap m{pa};
+            memcpy(bounce,m.ptr(),PhysMem::FRAME_SIZE);
+        }
+        device->write_blocks(slot * SECTORS_PER_SLOT, SECTORS_PER_SLOT, bounce);
+    }
+
+    static void read_slot(uint32_t slot, paddr_t pa) {
+        device->read_blocks(slot * SECTORS_PER_SLOT, SECTORS_PER_SLOT, bounce);
+        VMM::KMap m{pa};
+        memcpy(m.ptr(),bounce,PhysMem::FRAME_SIZE);
+    }
+
+    void init(Shared<Ide> dev) {
+        if (!dev->exists()) {
+            Debug::printf("| no swap device\n");
+            return;
+        }
+
+        auto hdr = (Header*) PhysMem::alloc_frame(true);
+        dev->read_blocks(0, SECTORS_PER_SLOT, (char*) hdr);
+
+        auto magic = (const char*) hdr + PhysMem::FRAME_SIZE - 10;
+        bool ok = true;
+        for (uint32_t i = 0; i < 10; i++) {
+            if (magic[i] != "SWAPSPACE2"[i]) ok = false;
+        }
+
+        if (!ok || (hdr->version != 1) || (hdr->last_page < 1) || (hdr->last_page >= (1 << 20))) {
+            Debug::printf("| no swap header, not swapping\n");
+            PhysMem::dealloc_frame((uint32_t) hdr);
+            return;
+        }
+
+        // mkswap could have been run on a bigger device
+        nSlots = K::min(hdr->last_page + 1, uint32_t(dev->size_in_sectors() / SECTORS_PER_SLOT));
+        used = new uint32_t[(nSlots + 31) / 32]();
+        mark(NO_SLOT,true);
+        for (uint32_t i = 0; i < hdr->nr_badpages; i++) {
+            auto bad = hdr->badpages[i];
+            if (bad < nSlots) mark(bad,true);
+        }
+        bounce = (char*) hdr;
+
+        device = dev;
+        Debug::printf("| swap area with %d pages\n",nSlots - 1);
+
+        // only the low frames count for the shrinker, high ones go back
+        // to the high pool where alloc_user_frame finds them
+        PhysMem::shrinker([](uint32_t wanted) -> uint32_t {
+            return swap_out(wanted);
+        });
+    }
+
+    bool swap_in(uint32_t* pd, uint32_t va) {
+        auto ptep = pte_for(pd,va,false);
+        if ((ptep == nullptr) || !is_swapped(*ptep)) return false;
+
+        // get the frame first, we might have to swap things out to get it
+        auto pa = PhysMem::alloc_user_frame(true);
+
+        LockGuard g{lock};
+
+        pte_t pte = *ptep;
+        if (!is_swapped(pte)) {
+            // somebody beat us to it
+            PhysMem::dealloc_user_frame(pa);
+            return true;
+        }
+
+        uint32_t slot = pte >> 12;
+        read_slot(slot,pa);
+        *ptep = pa | 7;
+        free_slot(slot);
+        nIn += 1;
+
+        return true;
+    }
+
+    void release(pte_t pte) {
+        ASSERT(is_swapped(pte));
+        free_slot(pte >> 12);
+    }
+
+    void forget(uint32_t* pd) {
+        LockGuard g{lock};
+        if (handPd == pd) {
+            handPd = nullptr;
+            handVa = USER_START;
+        }
+    }
+
+    // Tries to push the page mapped by "ptep" out, returns false if
+    // the address space started running under our feet. "low" says
+    // whether the frame it freed was a low one
+    static bool evict(uint32_t* pd, pte_t* ptep, uint32_t slot, bool& low) {
+        pte_t pte = *ptep;
+        *ptep = (pte_t(slot) << 12) | PTE_SWAP;
+
+        // The address space wasn't running when we picked the page. If
+        // it still isn't, no core can have a stale translation for it
+        // and the next one to run it will fault on the page.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (pd_in_use(pd)) {
+            *ptep = pte;
+            return false;
+        }
+
+        auto pa = pte_addr(pte);
+        write_slot(slot,pa);
+        low = (pa < PhysMem::LOW_LIMIT);
+        PhysMem::dealloc_user_frame(pa);
+        nOut += 1;
+        return true;
+    }
+
+    uint32_t swap_out(uint32_t wanted) {
+        if (device == nullptr) return 0;
+
+        LockGuard g{lock};
+
+        // pages pushed out, and how many of their frames were low ones
+        uint32_t freed = 0;
+        uint32_t freedLow = 0;
+
+        // Each address space gets visited at most twice: once to clear the
+        // accessed bits and once to evict the pages that weren't touched
+        uint32_t* first = nullptr;
+        uint32_t laps = 0;
+        uint32_t hops = 0;
+
+        while (freed < wanted) {
+            if ((handPd == nullptr) || (handVa >= VA_END)) {
+                handPd = next_pd(handPd);
+                handVa = USER_START;
+                if (handPd == nullptr) break;
+                if (first == nullptr) {
+                    first = handPd;
+                } else if ((handPd == first) && (++laps == 2)) {
+                    break;
+                }
+                if (++hops > 1024) break;
+            }
+
+            if (pd_in_use(handPd)) {
+                handVa = VA_END;
+                continue;
+            }
+
+            uint32_t va = handVa;
+            auto ptep = pte_for(handPd,va,false);
+            if (ptep == nullptr) {
+                // no page table, skip the whole thing
+                handVa = (handVa + PT_SPAN) & ~uint64_t(PT_SPAN - 1);
+                continue;
+            }
+            handVa += PhysMem::FRAME_SIZE;
+
+            pte_t pte = *ptep;
+            if ((pte & PTE_P) == 0) continue;
+            if ((va == kConfig.ioAPIC) || (va == kConfig.localAPIC)) continue;
+
+            if (pte & PTE_A) {
+                // second chance
+                *ptep = pte & ~PTE_A;
+                continue;
+            }
+
+            auto slot = alloc_slot();
+            if (slot == NO_SLOT) break;
+
+            bool low = false;
+            if (evict(handPd,ptep,slot,low)) {
+                freed += 1;
+                if (low) freedLow += 1;
+            } else {
+                free_slot(slot);
+                handVa = VA_END;
+            }
+        }
+
+        return freedLow;
+    }
+
+    void stats() {
+        Debug::printf("swap in %d\n",nIn);
+        Debug::printf("swap out %d\n",nOut);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include "stdint.h"
+#include "shared.h"
+#include "vmm.h"
+
+class Ide;
+
+//
+// Swapping of user pages
+//
+// When we run out of frames, user pages (0x80000000 and up) are written
+// to a swap area and their PTE is replaced with a "swapped" marker that
+// remembers the slot:
+//
+//        31 (63)    12 11   10    9  8 .. 1   0
+//     +--------------+-------+-----+------+---+
+//     |     slot     |   0   |  1  |  0   | 0 |
+//     +--------------+-------+-----+------+---+
+//
+// Victims are picked with a clock (second chance) over the PTE accessed
+// bits of the address spaces that are not running. The page fault handler
+// brings them back.
+//
+namespace Swap {
+
+    // Use the given drive as the swap area. It needs a Linux swap header
+    // (see mkswap), we leave the drive alone otherwise
+    void init(Shared<Ide> device);
+
+    inline bool is_swapped(gheith::pte_t pte) {
+        return ((pte & gheith::PTE_P) == 0) && ((pte & gheith::PTE_SWAP) != 0);
+    }
+
+    // Brings the page at "va" back from swap, returns false if it
+    // wasn't on swap to begin with
+    bool swap_in(uint32_t* pd, uint32_t va);
+
+    // Pushes up to "wanted" pages out to swap, returns how many low
+    // frames were freed (high ones don't count, see PhysMem::Shrinker)
+    uint32_t swap_out(uint32_t wanted);
+
+    // Gives back the slot used by a swapped PTE
+    void release(gheith::pte_t pte);
+
+    // "pd" is about to go away (it's off the ring already), waits for a
+    // page-out that might be walking it and moves the clock hand off it
+    void forget(uint32_t* pd);
+
+    void stats();
+}
+
+#endif
@@ -14,6 +14,9 @@
 #include "libk.h"
 #include "elf.h"
 #include "keyboard.h"
+#include "swap.h"
+#include "mount.h"
+#include "iostat.h"
 
 #define MAX_SEMAPHORES 10
 
@@ -89,31 +92,15 @@ int exit(int status) {
         me->exit->set(status);
     }
     
-    // Clean up virtual memory
+    // Clean up virtual memory (unmap also gives back swap slots)
     uint32_t *pd = current()->pd;
-    for (uint32_t pdi = 512; pdi < 1024; pdi++) {
-        uint32_t pde = pd[pdi];
-        if ((pde & 1) == 0) {
-            continue;
+    for_each_user_pte(pd, [pd](uint32_t va, pte_t*) {
+        if (va == kConfig.ioAPIC || va == kConfig.localAPIC) {
+            return;
         }
 
-        uint32_t *pt = (uint32_t*) (pde & 0xFFFFF000);
-
-        for (uint32_t pti = 0; pti < 1024; pti++) {
-            uint32_t pte = pt[pti];
-
-            if ((pte & 1) == 0) {
-                continue;
-            }
-
-            uint32_t va = (pdi << 22) | (pti << 12);
-            if (va == kConfig.ioAPIC || va == kConfig.localAPIC) {
-                continue;
-            }
-
-            unmap(pd, va);
-        }
-    }
+        unmap(pd, va);
+    });
 
     stop();
     return 0;
@@ -173,6 +160,39 @@ int write(int fd, char* buf, size_t nbytes) {
     return open_file->write(buf, nbytes);
 }
 
+int fsync(int fd) {
+    if (fd < 0 || fd >= 10) {
+        return -1;
+    }
+
+    Shared<OpenFile> open_file = current()->open_files[fd];
+    if (open_file == nullptr) {
+        return -1;
+    }
+
+    if (!open_file->consoleDevice) {
+        open_file->vnode->sync();
+    }
+    return 0;
+}
+
+int sync() {
+    Mounts::sync();
+    return 0;
+}
+
+int iostat(uint32_t device, struct iostat* out) {
+    if (!is_user((uint32_t) out, sizeof(struct iostat))) {
+        return -1;
+    }
+    struct iostat s;
+    if (!IoStats::get(device, s)) {
+        return -1;
+    }
+    memcpy(out, &s, sizeof(s));
+    return 0;
+}
+
 int fork(uint32_t *kernel_stack) {
     TCB *me = current();
 
@@ -204,17 +224,19 @@ int fork(uint32_t *kernel_stack) {
         }
 
         // Parent virtual memory
-        uint32_t pdi = addr >> 22;
-        uint32_t pde = my_pd[pdi];
+        pte_t *ptep = pte_for(my_pd, addr, false);
 
-        if ((pde & 1) == 0) {
+        if (ptep == nullptr) {
             continue;
         }
 
-        uint32_t *pt = (uint32_t*) (pde & 0xFFFFF000);
-        ASSERT(pt != nullptr);
-        uint32_t pti = (addr >> 12) & 0x3FF;
-        uint32_t pte = pt[pti];
+        pte_t pte = *ptep;
+
+        // Bring back pages that were swapped out
+        if (Swap::is_swapped(pte)) {
+            Swap::swap_in(my_pd, addr);
+            pte = *ptep;
+        }
 
         // Check if page is present
         if ((pte & 1) == 0) {
@@ -222,11 +244,14 @@ int fork(uint32_t *kernel_stack) {
         }
 
         // Copy page
-        uint32_t page = PhysMem::alloc_frame(false);
-        if (page == -1U) {
+        paddr_t page = PhysMem::alloc_user_frame(false);
+        if (page == paddr_t(-1)) {
             return -1;
         }
-        memcpy((uint32_t*) page, (uint32_t*) addr, PhysMem::FRAME_SIZE);
+        {
+            VMM::KMap to{page};
+            memcpy(to.ptr(), (uint32_t*) uint32_t(addr), PhysMem::FRAME_SIZE);
+        }
 
         map(pd, addr, page);
     }
@@ -344,6 +369,8 @@ int close(int id) {
 }
 
 int shutdown(void) {
+    // the last chance to leave the volumes clean
+    Mounts::unmount();
     Debug::shutdown();
     return 0;
 }
@@ -435,7 +462,11 @@ int execl(const char* path, const char** args) {
     return 0;
 }
 
-int open(const char* fn) {
+// user programs see these in sys.h
+#define O_APPEND 1
+#define O_TRUNC 2
+
+int open(const char* fn, int flags) {
     Shared<OpenFile> *open_files = current()->open_files;
     uint32_t available_id = 0;
 
@@ -462,12 +493,17 @@ int open(const char* fn) {
         return -1;
     }
 
+    if ((flags & O_TRUNC) && vnode->is_file()) {
+        vnode->truncate(0);
+    }
+
     // Create open file and add it to process's open files
     open_files[available_id] = Shared<OpenFile>::make(available_id, true, true, false);
 
 
     // Initialize open file
     open_files[available_id]->vnode = vnode;
+    open_files[available_id]->append = (flags & O_APPEND) != 0;
     return available_id;
 }
 
@@ -505,7 +541,8 @@ int removeStructure(char *fn) {
         
     // create file in directory
     Shared<Node> nodeToDelete = me->fs->find(parentNode, fn + index + 1);
-    bool res = nodeToDelete->deleteNode(parentNode);
+    auto name = fn + index + 1;
+    bool res = nodeToDelete->deleteNode(parentNode, name, K::strlen(name));
     return res ? 1 : -1;
 }
 
@@ -526,6 +563,40 @@ int read(int fd, void* buffer, ssize_t n) {
     return open_file->read(buffer, n);
 }
 
+int pread(int fd, void* buffer, size_t n, uint32_t off) {
+    if (fd < 0 || fd >= 10) {
+        return -1;
+    }
+
+    if (!is_user((uint32_t) buffer, n)) {
+        return -1;
+    }
+
+    Shared<OpenFile> open_file = current()->open_files[fd];
+    if ((open_file == nullptr) || open_file->consoleDevice) {
+        return -1;
+    }
+
+    return open_file->pread(buffer, n, off);
+}
+
+int pwrite(int fd, void* buffer, size_t n, uint32_t off) {
+    if (fd < 0 || fd >= 10) {
+        return -1;
+    }
+
+    if (!is_user((uint32_t) buffer, n)) {
+        return -1;
+    }
+
+    Shared<OpenFile> open_file = current()->open_files[fd];
+    if (open_file == nullptr) {
+        return -1;
+    }
+
+    return open_file->pwrite(buffer, n, off);
+}
+
 int seek(int fd, uint32_t off) {
     if (fd < 0 || fd >= 10) {
         return -1;
@@ -690,7 +761,7 @@ int makeStructure(char* fn, uint32_t structureType) {
     }
         
     // create file in directory
-    bool res = me->fs->createNode(directoryNode, fn + index + 1, structureType);
+    bool res = directoryNode->fileSystem->createNode(directoryNode, fn + index + 1, structureType);
 
     // directoryNode->get_entry_names(0, directoryNode->size_in_bytes());
     return res ? 1 : -1;
@@ -701,8 +772,8 @@ int copy(char* from, char* to) {
     // create the new file 
     makeStructure((char *) to, ENTRY_FILE_TYPE);
 
-    int fromFD = open((const char*) from);
-    int toFD = open((const char*) to);
+    int fromFD = open((const char*) from, 0);
+    int toFD = open((const char*) to, 0);
 
     while (1) {
         // char buf[100];
@@ -777,9 +848,9 @@ extern "C" int sysHandler(uint32_t eax, uint32_t *frame) {
         // execl(const char* path, const char* arg0, ....)
         case 9:
             return execl((char*) user_stack[1], (const char**) (user_stack + 2));
-        // open(const char* fn)
+        // open(const char* fn), what programs built before flags call
         case 10:
-            return open((char*) user_stack[1]);
+            return open((char*) user_stack[1], 0);
         // len(int fd)
         case 11:
             return len(user_stack[1]);
@@ -822,6 +893,30 @@ extern "C" int sysHandler(uint32_t eax, uint32_t *frame) {
         
         case 24:
             return makeStructure((char*) user_stack[1], ENTRY_DIRECTORY_TYPE);
+
+        // fsync(int fd)
+        case 25:
+            return fsync(user_stack[1]);
+
+        // sync()
+        case 26:
+            return sync();
+
+        // iostat(int device, struct iostat* out)
+        case 27:
+            return iostat(user_stack[1], (struct iostat*) user_stack[2]);
+
+        // pread(int fd, void* buf, size_t nbyte, off_t offset)
+        case 28:
+            return pread(user_stack[1], (void*) user_stack[2], user_stack[3], user_stack[4]);
+
+        // pwrite(int fd, void* buf, size_t nbyte, off_t offset)
+        case 29:
+            return pwrite(user_stack[1], (void*) user_stack[2], user_stack[3], user_stack[4]);
+
+        // open(const char* fn, int flags)
+        case 30:
+            return open((char*) user_stack[1], user_stack[2]);
     }
 
     return 0;
@@ -45,7 +45,8 @@ namespace gheith {
 
     struct Redirection {
         Shared<Node> output_file;
-        uint32_t offset;
+        uint32_t offset;        // where the next write goes
+        bool append;            // ">>", every write goes to the end
     };
 
     struct TCB {
@@ -86,6 +87,9 @@ namespace gheith {
 
         char *dir_name;
 
+        // how many journal handles we're in (see journal.cc)
+        uint32_t journalDepth = 0;
+
         Atomic<uint32_t> ref_count;
 
         TCB(bool isIdle);
@@ -11,6 +11,16 @@ class OpenFile {
         bool readable;
         bool writeable;
         bool consoleDevice;
+        bool append = false;        // writes go to the end of the file
+
+        // Read-ahead: a read that starts where the previous one ended is
+        // sequential. Sequential readers get a window that doubles up to
+        // RA_MAX, anything else turns it off until the reads line up again.
+        static constexpr uint32_t RA_MIN = 16 * 1024;
+        static constexpr uint32_t RA_MAX = 256 * 1024;
+        uint32_t raNext = 0;        // where a sequential read would start
+        uint32_t raEnd = 0;         // everything before this has been asked for
+        uint32_t raWindow = 0;      // 0 -> not sequential
 
         OpenFile(uint32_t fd, bool readable, bool writeable, bool consoleDevice) : ref_count(0) {
             this->offset = 0;
@@ -26,13 +36,44 @@ class OpenFile {
                 return -1;
             }
 
-            uint32_t to_read = K::min(vnode->size_in_bytes() - offset, n);
-            uint32_t actually_read = vnode->read_all(offset, to_read, (char*) buffer);
-            // Debug::printf("to read: %d, actually read: %d\n", to_read, actually_read);
+            int actually_read = pread(buffer, n, offset);
+            if (actually_read < 0) return actually_read;
+            readahead(offset, offset + actually_read);
             offset += actually_read;
             return actually_read;
         }
 
+        // Reads at "at", the offset stays where it is
+        int pread(void *buffer, uint32_t n, uint32_t at) {
+            if (!this->readable) {
+                return -1;
+            }
+
+            auto size = vnode->size_in_bytes();
+            if (at >= size) return 0;
+            uint32_t to_read = K::min(size - at, n);
+            return vnode->read_all(at, to_read, (char*) buffer);
+        }
+
+        // [start,end) was just read
+        void readahead(uint32_t start, uint32_t end) {
+            if (start != raNext) {
+                raWindow = 0;
+                raEnd = end;
+            } else {
+                if (raWindow == 0) raWindow = RA_MIN;
+                // top up once we're into the second half of what we asked for
+                if (end + raWindow / 2 > raEnd) {
+                    auto from = K::max(raEnd, end);
+                    auto to = end + raWindow;
+                    vnode->prefetch(from, to - from);
+                    raEnd = to;
+                    raWindow = K::min(2 * raWindow, RA_MAX);
+                }
+            }
+            raNext = end;
+        }
+
         int write(void *buffer, uint32_t n) {
             auto me = gheith::current();
             if (!this->writeable) {
@@ -46,13 +87,35 @@ class OpenFile {
                         me->shell->printf("%c", ((char*) buffer)[i]);
                     }
                 } else {
-                    redirect_data->output_file->write_all(redirect_data->offset, (char*) buffer, n);
+                    auto file = redirect_data->output_file;
+                    if (redirect_data->append) redirect_data->offset = file->size_in_bytes();
+                    file->write_all(redirect_data->offset, (char*) buffer, n);
+                    redirect_data->offset += n;
                 }
                 me->shell->refresh();
             } else { // write to file
-                vnode->write_all(0, (char *) buffer, n);
+                if (append) offset = vnode->size_in_bytes();
+                int written = pwrite(buffer, n, offset);
+                if (written < 0) return written;
+                offset += written;
+                // short when the volume is full
+                return written;
             }
 
             return n;
         }
+
+        // Writes at "at", the offset stays where it is. Files can't have
+        // holes, so "at" can be the end of the file but not past it
+        int pwrite(void *buffer, uint32_t n, uint32_t at) {
+            if (!this->writeable || consoleDevice) {
+                return -1;
+            }
+
+            if (at > vnode->size_in_bytes()) {
+                return -1;
+            }
+
+            return vnode->write_all(at, (char *) buffer, n);
+        }
 };
\ No newline at end of file
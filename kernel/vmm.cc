@@ -8,6 +8,7 @@
 #include "debug.h"
 #include "ext2.h"
 #include "physmem.h"
+#include "swap.h"
 
 
 namespace gheith {
@@ -16,51 +17,147 @@ namespace gheith {
 
     uint32_t* shared = nullptr;
 
-    void map(uint32_t* pd, uint32_t va, uint32_t pa) {
+    // The ring of page directories, swap walks it looking for victims
+    struct PdNode {
+        uint32_t* pd;
+        PdNode* next;
+    };
+
+    static PdNode* pds = nullptr;
+    static InterruptSafeLock pdsLock{};
+
+#if PAE
+    // The 4 PDPTEs get loaded with CR3, the top two (user space) get
+    // their page directories up front. The bottom two are shared.
+    pte_t* pte_for(uint32_t* pd, uint32_t va, bool create) {
+        auto pdpt = (uint64_t*) pd;
+        auto dir = (uint64_t*) uint32_t(pdpt[va >> 30] & PTE_ADDR);
+        auto pdi = (va >> 21) & 0x1FF;
+        auto pti = (va >> 12) & 0x1FF;
+        auto pde = dir[pdi];
+        if ((pde & 1) == 0) {
+            if (!create) return nullptr;
+            pde = PhysMem::alloc_frame(true) | 7;
+            dir[pdi] = pde;
+        }
+        auto pt = (uint64_t*) uint32_t(pde & PTE_ADDR);
+        return &pt[pti];
+    }
+#else
+    pte_t* pte_for(uint32_t* pd, uint32_t va, bool create) {
         auto pdi = va >> 22;
         auto pti = (va >> 12) & 0x3FF;
         auto pde = pd[pdi];
         if ((pde & 1) == 0) {
+            if (!create) return nullptr;
             pde = PhysMem::alloc_frame(true) | 7;
             pd[pdi] = pde;
         }
         auto pt = (uint32_t*) (pde & 0xFFFFF000);
-        pt[pti] = pa | 7;
+        return &pt[pti];
+    }
+#endif
+
+    void map(uint32_t* pd, uint32_t va, paddr_t pa) {
+        *pte_for(pd,va,true) = pte_t(pa) | 7;
     }
 
     void unmap(uint32_t* pd, uint32_t va) {
-        auto pdi = va >> 22;
-        auto pti = (va >> 12) & 0x3FF;
-        auto pde = pd[pdi];
-        if ((pde & 1) == 0) return;
-        auto pt = (uint32_t*) (pd[pdi] & 0xFFFFF000);
-        auto pte = pt[pti];
-        if ((pte & 1) == 0) return;
-        auto pa = pte & 0xFFFFF000;
-        pt[pti] = 0;
-        dealloc_frame(pa);
+        auto ptep = pte_for(pd,va,false);
+        if (ptep == nullptr) return;
+        auto pte = *ptep;
+        if ((pte & PTE_P) == 0) {
+            if (Swap::is_swapped(pte)) {
+                *ptep = 0;
+                Swap::release(pte);
+            }
+            return;
+        }
+        auto pa = pte_addr(pte);
+        *ptep = 0;
+        dealloc_user_frame(pa);
         invlpg(va);
     }
 
+    uint32_t* next_pd(uint32_t* pd) {
+        LockGuard g{pdsLock};
+        if (pds == nullptr) return nullptr;
+        for (auto p = pds; p != nullptr; p = p->next) {
+            if (p->pd == pd) {
+                return (p->next == nullptr) ? pds->pd : p->next->pd;
+            }
+        }
+        return pds->pd;
+    }
+
+    bool pd_in_use(uint32_t* pd) {
+        if (activeThreads == nullptr) return true;
+        for (uint32_t i = 0; i < kConfig.totalProcs; i++) {
+            auto t = activeThreads[i];
+            if ((t != nullptr) && (t->pd == pd)) return true;
+        }
+        return false;
+    }
+
     uint32_t* make_pd() {
         auto pd = (uint32_t*) PhysMem::alloc_frame(true);
 
-        auto m4 = 4 * 1024 * 1024;
-        auto shared_size = 4 * (((kConfig.memSize + m4 - 1) / m4));
-
-        memcpy(pd,shared,shared_size);
+#if PAE
+        auto pdpt = (uint64_t*) pd;
+        auto kernel = (uint64_t*) shared;
+        pdpt[0] = kernel[0];
+        pdpt[1] = kernel[1];
+        pdpt[2] = PhysMem::alloc_frame(true) | 1;
+        pdpt[3] = PhysMem::alloc_frame(true) | 1;
+#else
+        // the kernel half is shared, including the kmap page table
+        memcpy(pd,shared,512 * sizeof(uint32_t));
+#endif
 
         map(pd,kConfig.ioAPIC,kConfig.ioAPIC);
         map(pd,kConfig.localAPIC,kConfig.localAPIC);
 
+        auto node = new PdNode();
+        node->pd = pd;
+        {
+            LockGuard g{pdsLock};
+            node->next = pds;
+            pds = node;
+        }
+
         return pd;
     }
 
     void delete_pd(uint32_t* pd) {
+        {
+            LockGuard g{pdsLock};
+            PdNode* prev = nullptr;
+            for (auto p = pds; p != nullptr; prev = p, p = p->next) {
+                if (p->pd == pd) {
+                    if (prev == nullptr) pds = p->next; else prev->next = p->next;
+                    delete p;
+                    break;
+                }
+            }
+        }
+        // swap_out could be in the middle of it
+        Swap::forget(pd);
+#if PAE
+        auto pdpt = (uint64_t*) pd;
+        for (unsigned i=2; i<4; i++) {
+            auto dir = (uint64_t*) uint32_t(pdpt[i] & PTE_ADDR);
+            for (unsigned j=0; j<512; j++) {
+                auto pde = dir[j];
+                if (pde & 1) dealloc_frame(uint32_t(pde & PTE_ADDR));
+            }
+            dealloc_frame((uint32_t) dir);
+        }
+#else
         for (unsigned i=512; i<1024; i++) {
             auto pde = pd[i];
             if (pde & 1) dealloc_frame(pde & 0xFFFFF000);
         }
+#endif
         PhysMem::dealloc_frame((uint32_t)pd);
     }
 }
@@ -71,11 +168,62 @@ void global_init() {
     using namespace gheith;
     shared = (uint32_t*) PhysMem::alloc_frame(true);
 
-    for (uint32_t va = FRAME_SIZE; va < kConfig.memSize; va += FRAME_SIZE) {
+#if PAE
+    auto pdpt = (uint64_t*) shared;
+    pdpt[0] = PhysMem::alloc_frame(true) | 1;
+    pdpt[1] = PhysMem::alloc_frame(true) | 1;
+#endif
+
+    auto lowEnd = K::min(kConfig.memSize, PhysMem::LOW_LIMIT);
+    for (uint32_t va = FRAME_SIZE; va < lowEnd; va += FRAME_SIZE) {
         map(shared,va,va);
     }
 
+    // page tables for the kmap window, shared by everyone
+    for (uint32_t va = KMAP_BASE; va < USER_START; va += PT_SPAN) {
+        pte_for(shared,va,true);
+    }
+}
+
+// Each core gets KMAP_DEPTH slots in the kmap window. They are only ever
+// used with interrupts disabled so a mapping can't migrate to another
+// core and we don't need TLB shootdowns.
+static uint32_t kmapDepth[MAX_PROCS];
+static bool kmapWas[MAX_PROCS][KMAP_DEPTH];
+
+void* kmap(PhysMem::paddr_t pa) {
+    using namespace gheith;
+
+    if (pa < PhysMem::LOW_LIMIT) return (void*) uint32_t(pa);
+
+    auto was = Interrupts::disable();
+    auto id = SMP::me();
+    auto depth = kmapDepth[id];
+    ASSERT(depth < KMAP_DEPTH);
+    kmapDepth[id] = depth + 1;
+    kmapWas[id][depth] = was;
+
+    uint32_t va = KMAP_BASE + (id * KMAP_DEPTH + depth) * PhysMem::FRAME_SIZE;
+    *pte_for(shared,va,false) = pte_t(pa) | 3;
+    invlpg(va);
+    return (void*) va;
+}
+
+void kunmap(void* ptr) {
+    using namespace gheith;
+
+    uint32_t va = (uint32_t) ptr;
+    if (va < KMAP_BASE) return;
+
+    ASSERT(Interrupts::isDisabled());
+    auto id = SMP::me();
+    auto depth = kmapDepth[id] - 1;
+    ASSERT(va == KMAP_BASE + (id * KMAP_DEPTH + depth) * PhysMem::FRAME_SIZE);
 
+    *pte_for(shared,va,false) = 0;
+    invlpg(va);
+    kmapDepth[id] = depth;
+    Interrupts::restore(kmapWas[id][depth]);
 }
 
 void per_core_init() {
@@ -103,8 +251,9 @@ extern "C" void vmm_pageFault(uintptr_t va_, uintptr_t *saveState) {
 
     uint32_t va = PhysMem::framedown(va_);
 
-    if (va >= 0x80000000) {
-        auto pa = PhysMem::alloc_frame(true);
+    if (va >= USER_START) {
+        if (Swap::swap_in(me->pd,va)) return;
+        auto pa = PhysMem::alloc_user_frame(true);
         map(me->pd,va,pa);
         return;
     }
@@ -2,12 +2,71 @@
 #define _VMM_H_
 
 #include "stdint.h"
+#include "physmem.h"
 
 namespace gheith {
+
+    using PhysMem::paddr_t;
+
+    //
+    // Classic paging: pd -> (1024 x 32 bit PDEs) -> PT -> (1024 x 32 bit PTEs)
+    // PAE paging:     pd -> (4 x 64 bit PDPTEs) -> PD -> (512 x 64 bit PDEs) -> PT -> (512 x 64 bit PTEs)
+    //
+    // Either way, the rest of the kernel treats a "pd" as an opaque pointer
+    // to the top level table (it's what we load in CR3) and uses pte_for
+    // to get to the PTEs.
+    //
+#if PAE
+    typedef uint64_t pte_t;
+    constexpr uint64_t PTE_ADDR = 0x000FFFFFFFFFF000ull;
+    constexpr uint32_t PT_SPAN = 1 << 21;    // bytes mapped by a page table
+#else
+    typedef uint32_t pte_t;
+    constexpr uint32_t PTE_ADDR = 0xFFFFF000;
+    constexpr uint32_t PT_SPAN = 1 << 22;
+#endif
+
+    constexpr uint32_t USER_START = 0x80000000;
+
+    // PTE bits
+    constexpr uint32_t PTE_P = 0x001;       // present
+    constexpr uint32_t PTE_A = 0x020;       // accessed
+    constexpr uint32_t PTE_SWAP = 0x200;    // (available to us) not present, on swap
+
+    inline paddr_t pte_addr(pte_t pte) {
+        return pte & PTE_ADDR;
+    }
+
     extern uint32_t* make_pd();
     extern void delete_pd(uint32_t*);
-    extern void map(uint32_t* pd, uint32_t va, uint32_t pa);
+    extern void map(uint32_t* pd, uint32_t va, paddr_t pa);
     extern void unmap(uint32_t* pd, uint32_t va);
+
+    // Returns a pointer to the PTE that maps "va" in "pd". Returns nullptr
+    // if there is no page table for it and "create" is false
+    extern pte_t* pte_for(uint32_t* pd, uint32_t va, bool create);
+
+    // Calls work(va,pte*) for every non-empty PTE in the user half of "pd"
+    template <typename Work>
+    void for_each_user_pte(uint32_t* pd, Work work) {
+        uint64_t va = USER_START;
+        while (va < 0x100000000ull) {
+            auto ptep = pte_for(pd,va,false);
+            if (ptep == nullptr) {
+                va = (va + PT_SPAN) & ~uint64_t(PT_SPAN - 1);
+                continue;
+            }
+            if (*ptep != 0) work(uint32_t(va),ptep);
+            va += PhysMem::FRAME_SIZE;
+        }
+    }
+
+    // The page directories that exist form a ring, this returns the one
+    // after "pd" (or the first one if "pd" is nullptr or no longer exists)
+    extern uint32_t* next_pd(uint32_t* pd);
+
+    // true if a core is currently running with "pd" in its CR3
+    extern bool pd_in_use(uint32_t* pd);
 }
 
 namespace VMM {
@@ -17,6 +76,34 @@ namespace VMM {
 
     // Called on each core to do per-core initialization
     extern void per_core_init();
+
+    // The last 4MB below user space are used for temporary mappings
+    constexpr uint32_t KMAP_BASE = PhysMem::LOW_LIMIT;
+    constexpr uint32_t KMAP_DEPTH = 4;      // nested mappings per core
+
+    extern void* kmap(PhysMem::paddr_t pa);
+    extern void kunmap(void* va);
+
+    //
+    // Gives the kernel access to a frame that might not be identity
+    // mapped (high memory). Low frames are returned as is.
+    //
+    //     {
+    //         VMM::KMap m{pa};
+    //         bzero(m.ptr(),PhysMem::FRAME_SIZE);
+    //     }
+    //
+    // High frames are mapped in a per-core slot, interrupts stay disabled
+    // until the mapping goes away so keep it short and don't block.
+    //
+    class KMap {
+        void* va;
+    public:
+        explicit KMap(PhysMem::paddr_t pa) : va(kmap(pa)) {}
+        KMap(const KMap&) = delete;
+        ~KMap() { kunmap(va); }
+        void* ptr() const { return va; }
+    };
 }
 
 #endif
@@ -8,7 +8,7 @@ int main(int argc, char** argv) {
     }
     
     char *fileName = argv[1];
-    int file_fd = open(fileName);
+    int file_fd = open(fileName, 0);
     if (file_fd < 0) {
         printf("File %s doesn't exist\n", fileName);
         return -1;
@@ -20,8 +20,14 @@ int main(int argc, char** argv) {
         uint32_t readCount = readShellLine(buffer + bytesRead);
         buffer[bytesRead + readCount] = 0;
         if (streq(buffer + bytesRead, ":wq")) {
+            // replace the file and quit
+            close(file_fd);
+            file_fd = open(fileName, O_TRUNC);
+            if (file_fd < 0) {
+                printf("\nCan't write %s\n", fileName);
+                return -1;
+            }
             write(file_fd, buffer, bytesRead);
-            // write to file and quit
             break;
         } else if (streq(buffer + bytesRead, ":q")) {
             // quit
@@ -7,7 +7,7 @@ int main(int argc, char** argv) {
     }
     
     char *fileName = argv[1];
-    int file_fd = open(fileName);
+    int file_fd = open(fileName, 0);
     if (file_fd < 0) {
         printf("File %s doesn't exist\n", fileName);
         return -1;
@@ -0,0 +1,25 @@
+#include "libc.h"
+
+/* the kernel keeps track of this many */
+#define MAX_DEVICES 8
+
+/* prints the counters and latency histograms of every block device */
+int main(int argc, char** argv) {
+    struct iostat s;
+    for (int i = 0; i < MAX_DEVICES; i++) {
+        if (iostat(i, &s) != 0) continue;
+
+        printf("%s: %lu reads %lu KB, %lu writes %lu KB, %lu flushes, %lu DMA\n",
+            s.name, s.reads, (uint32_t) (s.bytesRead >> 10),
+            s.writes, (uint32_t) (s.bytesWritten >> 10), s.flushes, s.dma);
+        printf("    %lu requests, %lu merged, %lu queued, %lu max queued\n",
+            s.requests, s.merged, s.queued, s.maxQueued);
+        printf("    cache %lu hits, %lu misses\n", s.cacheHits, s.cacheMisses);
+        printf("    log2(cycles)  service     wait\n");
+        for (int b = 0; b < 32; b++) {
+            if (s.serviceTime[b] == 0 && s.waitTime[b] == 0) continue;
+            printf("    %12d %8lu %8lu\n", b, s.serviceTime[b], s.waitTime[b]);
+        }
+    }
+    return 0;
+}
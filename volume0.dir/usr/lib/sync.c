@@ -0,0 +1,21 @@
+#include "libc.h"
+
+/* sync: everything cached goes to the disk */
+/* sync <file>...: just those files (fsync) */
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        sync();
+        return 0;
+    }
+
+    int rc = 0;
+    for (int i = 1; i < argc; i++) {
+        int fd = open(argv[i], 0);
+        if (fd < 0 || fsync(fd) < 0) {
+            printf("sync: can't sync %s\n", argv[i]);
+            rc = -1;
+        }
+        if (fd >= 0) close(fd);
+    }
+    return rc;
+}
@@ -21,8 +21,12 @@ extern void exit(int rc);
 int readShellLine(char *buf);
 
 /* open */
-/* opens a file, returns file descriptor, flags is ignored */
-extern int open(const char* fn);
+/* opens a file, returns file descriptor */
+/* with O_APPEND every write goes to the end of the file */
+/* O_TRUNC empties the file first */
+#define O_APPEND 1
+#define O_TRUNC 2
+extern int open(const char* fn, int flags);
 
 /* len */
 /* returns number of bytes in the file, negative indicates error or a console device */
@@ -36,6 +40,12 @@ extern ssize_t write(int fd, void* buf, size_t nbyte);
 /* reads up to nbytes from file, returns number of bytes read */
 extern ssize_t read(int fd, void* buf, size_t nbyte);
 
+/* pread, pwrite */
+/* same as read and write but at 'offset', the file offset doesn't move */
+/* writing past the end of the file is an error (no holes) */
+extern ssize_t pread(int fd, void* buf, size_t nbyte, off_t offset);
+extern ssize_t pwrite(int fd, void* buf, size_t nbyte, off_t offset);
+
 /* create semaphore */
 /* returns semaphore descriptor */
 extern int sem(uint32_t initial);
@@ -94,4 +104,37 @@ extern int mkdir(const char *fn);
 
 extern int removeStructure(char *fn);
 
+/* fsync */
+/* writes the file's data and metadata to the disk */
+/* return 0 on success, -ve value on failure */
+extern int fsync(int fd);
+
+/* sync */
+/* writes everything that is cached to the disk */
+extern int sync(void);
+
+/* iostat */
+/* the counters of a block device, devices are numbered from 0 */
+/* latencies are in TSC cycles, bucket i counts [2^i,2^(i+1)) */
+struct iostat {
+    char name[8];
+    uint32_t reads;             /* commands */
+    uint32_t writes;
+    uint32_t flushes;
+    uint32_t dma;               /* commands that used DMA */
+    uint32_t requests;          /* before merging */
+    uint32_t merged;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint32_t queued;            /* waiting or running now */
+    uint32_t maxQueued;
+    uint32_t cacheHits;
+    uint32_t cacheMisses;
+    uint32_t serviceTime[32];   /* the command */
+    uint32_t waitTime[32];      /* submit to done */
+};
+
+/* return 0 on success, -1 if there is no such device */
+extern int iostat(int device, struct iostat* out);
+
 #endif
\ No newline at end of file